@@ -0,0 +1,457 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+
+////////////////////////////////
+// Load generator for the relay server.
+// Opens a lot of loopback connections, has a few of them
+// send timestamped frames at a fixed rate and measures how
+// long it takes until the server delivers them to the rest.
+
+typedef uint64_t u64;
+typedef uint32_t u32;
+typedef uint16_t u16;
+typedef uint8_t  byte;
+
+#define T_USER 1
+#define T_JOIN 5
+#define HDR_SZ 6
+#define MAX_FRAME (HDR_SZ+65535)
+// Send time + sequence number + run id
+#define MIN_BODY 24
+// Latency samples we keep, the rest is reservoir-sampled
+#define MAX_SAMPLES (1 << 22)
+
+typedef struct Conn Conn;
+struct Conn {
+    int fd;
+    byte *in;
+    size_t in_len;
+};
+
+////////////////////////////////
+// Options
+
+int conns_n = 1000;
+int senders_n = 10;
+size_t body_sz = 64;
+u64 rate = 1000;
+int duration = 10;
+int server_pid = 0;
+// Connection i joins room i % rooms_n
+int rooms_n = 1;
+
+////////////////////////////////
+
+u64 *samples = NULL;
+u64 samples_n = 0, delivered = 0, sent = 0, expected = 0;
+u64 bytes_in = 0;
+// Tells our frames from ones the server replays from its
+// history, e.g. of an earlier run
+u64 run_id = 0;
+
+////////////////////////////////
+// Helpers
+
+u64 now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+u16 h16(byte *data) {
+    return data[0] | ((u16)data[1] << 8);
+}
+
+void put64(byte *p, u64 v) {
+    for (int i = 0; i < 8; i++) p[i] = v >> (8*i);
+}
+
+u64 get64(byte *p) {
+    u64 v = 0;
+    for (int i = 0; i < 8; i++) v |= (u64)p[i] << (8*i);
+    return v;
+}
+
+int parseip(const char *ip, u32 *addr, u16 *p) {
+    byte a, b, c, d;
+    u16 port;
+    
+    if (sscanf(ip,
+               "%hhu.%hhu.%hhu.%hhu:%hu",
+               &a, &b, &c, &d, &port) < 5) {
+        return 1;
+    }
+    
+    *addr = d | (c << 8) | (b << 16) | (a << 24);
+    *p = port;
+    
+    return 0;
+}
+
+// User + system time of a process, in ns
+u64 cpu_ns(int pid) {
+    if (pid == 0) {
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        return ((u64)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec)*1000000000 +
+            ((u64)ru.ru_utime.tv_usec + ru.ru_stime.tv_usec)*1000;
+    }
+    
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return 0;
+    size_t len = fread(buf, 1, sizeof(buf)-1, f);
+    fclose(f);
+    buf[len] = 0;
+    
+    // utime and stime are fields 14 and 15, after "(comm)"
+    char *p = strrchr(buf, ')');
+    unsigned long long ut, st;
+    if (p == NULL ||
+        sscanf(p+2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+               &ut, &st) < 2)
+        return 0;
+    
+    return (ut + st) * (1000000000 / sysconf(_SC_CLK_TCK));
+}
+
+////////////////////////////////
+
+void record(u64 lat) {
+    delivered++;
+    
+    if (samples_n < MAX_SAMPLES) {
+        samples[samples_n++] = lat;
+        return;
+    }
+    
+    // Reservoir sampling keeps the percentiles honest
+    u64 j = ((u64)rand() << 31 | rand()) % delivered;
+    if (j < MAX_SAMPLES) samples[j] = lat;
+}
+
+// Parse every complete frame and keep the partial tail
+void consume(Conn *c) {
+    size_t off = 0;
+    u64 now = now_ns();
+    
+    while (c->in_len - off >= HDR_SZ) {
+        size_t sz = HDR_SZ + h16(c->in+off+2);
+        if (c->in_len - off < sz) break;
+        
+        if (sz >= HDR_SZ + MIN_BODY && get64(c->in+off+HDR_SZ+16) == run_id) {
+            record(now - get64(c->in+off+HDR_SZ));
+        }
+        off += sz;
+    }
+    
+    memmove(c->in, c->in+off, c->in_len-off);
+    c->in_len -= off;
+}
+
+// Returns 0 when the connection is gone
+int receive(Conn *c) {
+    while (1) {
+        ssize_t res = recv(c->fd, c->in+c->in_len, MAX_FRAME-c->in_len, 0);
+        
+        if (res < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            if (errno == EINTR) continue;
+            perror("recv()");
+            return 0;
+        }
+        if (res == 0) {
+            printf("The server closed a connection\n");
+            return 0;
+        }
+        
+        bytes_in += res;
+        c->in_len += res;
+        consume(c);
+    }
+}
+
+void sendframe(Conn *c, byte *frame, size_t len, u64 seq) {
+    put64(frame+HDR_SZ, now_ns());
+    put64(frame+HDR_SZ+8, seq);
+    put64(frame+HDR_SZ+16, run_id);
+    
+    // The load is light per sender, a short write means the
+    // server isn't keeping up
+    ssize_t res = send(c->fd, frame, len, MSG_NOSIGNAL);
+    if (res < 0 && errno != EAGAIN) perror("send()");
+    if (res == (ssize_t)len) sent++;
+}
+
+int cmp64(const void *a, const void *b) {
+    u64 x = *(const u64*)a, y = *(const u64*)b;
+    return x < y ? -1 : x > y;
+}
+
+double pct(double p) {
+    if (samples_n == 0) return 0;
+    size_t i = p * (samples_n-1);
+    return samples[i] / 1000.0;
+}
+
+////////////////////////////////
+
+int finish = 0;
+void intrhandle(int _sig) {
+    (void)_sig;
+    finish = 1;
+}
+
+void usage(const char *name) {
+    printf("Usage: %s [options] <ip:port>\n"
+           "  --conns N       connections to open (default %d)\n"
+           "  --senders N     how many of them send (default %d)\n"
+           "  --size BYTES    message body size (default %zu)\n"
+           "  --rate N        messages per second, all senders (default %llu)\n"
+           "  --duration S    seconds to run (default %d)\n"
+           "  --rooms N       spread the connections over N rooms (default %d)\n"
+           "  --server-pid P  also report the server's CPU time\n",
+           name, conns_n, senders_n, body_sz,
+           (unsigned long long)rate, duration, rooms_n);
+}
+
+int main(int argc, char **argv) {
+    static struct option opts[] = {
+        {"conns",      required_argument, 0, 'c'},
+        {"senders",    required_argument, 0, 's'},
+        {"size",       required_argument, 0, 'z'},
+        {"rate",       required_argument, 0, 'r'},
+        {"duration",   required_argument, 0, 'd'},
+        {"rooms",      required_argument, 0, 'm'},
+        {"server-pid", required_argument, 0, 'p'},
+        {"help",       no_argument,       0, 'h'},
+        {0}
+    };
+    
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'c': conns_n = atoi(optarg); break;
+        case 's': senders_n = atoi(optarg); break;
+        case 'z': body_sz = atoi(optarg); break;
+        case 'r': rate = strtoull(optarg, NULL, 10); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'm': rooms_n = atoi(optarg); break;
+        case 'p': server_pid = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (argc - optind != 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    
+    if (conns_n < 2 || senders_n < 1 || senders_n > conns_n ||
+        rate == 0 || duration <= 0 || rooms_n < 1 || rooms_n > conns_n) {
+        printf("Invalid options\n");
+        return 1;
+    }
+    
+    if (body_sz < MIN_BODY) body_sz = MIN_BODY;
+    if (body_sz > 65535) body_sz = 65535;
+    
+    u32 addr;
+    u16 port;
+    
+    if (parseip(argv[optind], &addr, &port)) {
+        printf("Malformed ip address\n"
+               "Should match XXX.XXX.XXX.XXX:PORT\n");
+        return 1;
+    }
+    
+    signal(SIGINT, intrhandle);
+    
+    ////////////////////////////////
+    // We need a descriptor per connection
+    
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < (rlim_t)conns_n + 16) {
+        rl.rlim_cur = conns_n + 16;
+        if (rl.rlim_cur > rl.rlim_max) rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    
+    ////////////////////////////////
+    // Connect
+    
+    int ep = epoll_create1(0);
+    Conn *conns = calloc(conns_n, sizeof(Conn));
+    samples = malloc(sizeof(u64)*MAX_SAMPLES);
+    
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(struct sockaddr_in));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(addr);
+    sa.sin_port = htons(port);
+    
+    for (int i = 0; i < conns_n; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (fd < 0) {
+            perror("socket()");
+            return 1;
+        }
+        
+        if (connect(fd, (struct sockaddr*)&sa, sizeof(struct sockaddr_in)) < 0) {
+            perror("connect()");
+            return 1;
+        }
+        
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        
+        conns[i].fd = fd;
+        conns[i].in = malloc(MAX_FRAME);
+        
+        if (rooms_n > 1) {
+            byte join[HDR_SZ+16] = { T_JOIN };
+            int len = snprintf((char*)join+HDR_SZ, 16, "bench%d", i % rooms_n);
+            join[2] = len;
+            if (send(fd, join, HDR_SZ+len, MSG_NOSIGNAL) < 0) {
+                perror("send()");
+                return 1;
+            }
+        }
+        
+        struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLET,
+            .data.ptr = &conns[i]
+        };
+        epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+    }
+    
+    printf("Opened %d connections in %d room(s), %d sending %llu msg/s of %zu bytes\n",
+           conns_n, rooms_n, senders_n, (unsigned long long)rate, body_sz);
+    
+    // Let the server register everybody before we start
+    sleep(1);
+    
+    ////////////////////////////////
+    // Pace the senders with a 1ms timer
+    
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    struct itimerspec its = {
+        .it_interval = { .tv_nsec = 1000000 },
+        .it_value = { .tv_nsec = 1000000 }
+    };
+    timerfd_settime(tfd, 0, &its, NULL);
+    
+    struct epoll_event tev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(ep, EPOLL_CTL_ADD, tfd, &tev);
+    
+    byte *frame = calloc(1, HDR_SZ+body_sz);
+    frame[0] = T_USER;
+    frame[2] = body_sz & 0xFF;
+    frame[3] = (body_sz & 0xFF00) >> 8;
+    frame[4] = 'b';
+    frame[5] = 'n';
+    
+    run_id = now_ns() ^ ((u64)getpid() << 32);
+    u64 start = now_ns(), end = start + (u64)duration*1000000000;
+    u64 cpu0 = cpu_ns(0), scpu0 = server_pid ? cpu_ns(server_pid) : 0;
+    u64 seq = 0;
+    int next = 0;
+    
+    struct epoll_event events[256];
+    
+    while (!finish) {
+        int ret = epoll_wait(ep, events, 256, 100);
+        u64 now = now_ns();
+        
+        if (ret < 0 && errno != EINTR) {
+            perror("epoll_wait()");
+            break;
+        }
+        
+        for (int i = 0; i < ret; i++) {
+            Conn *c = events[i].data.ptr;
+            
+            if (c == NULL) {
+                u64 ticks;
+                if (read(tfd, &ticks, sizeof(ticks)) < 0) continue;
+                if (now >= end) continue;
+                
+                // Catch up with the schedule
+                u64 due = (now - start) * rate / 1000000000;
+                for (; seq < due; seq++) {
+                    u64 before = sent;
+                    sendframe(&conns[next], frame, HDR_SZ+body_sz, seq);
+                    // Everybody else in the sender's room
+                    int room = next % rooms_n;
+                    if (sent != before) {
+                        expected += conns_n / rooms_n + (room < conns_n % rooms_n) - 1;
+                    }
+                    next = (next + 1) % senders_n;
+                }
+                continue;
+            }
+            
+            if (!receive(c)) finish = 1;
+        }
+        
+        // Give the last messages a moment to arrive
+        if (now >= end + 500000000) break;
+    }
+    
+    ////////////////////////////////
+    // Report
+    
+    double secs = (now_ns() - start) / 1e9;
+    u64 cpu = cpu_ns(0) - cpu0;
+    
+    qsort(samples, samples_n, sizeof(u64), cmp64);
+    
+    printf("Sent       %llu msgs (%.0f msg/s)\n",
+           (unsigned long long)sent, (double)sent / duration);
+    printf("Delivered  %llu msgs (%.0f msg/s, %.1f MB/s)\n",
+           (unsigned long long)delivered, delivered / secs,
+           bytes_in / secs / 1e6);
+    printf("Expected   %llu deliveries\n",
+           (unsigned long long)expected);
+    printf("Latency    p50 %.1fus  p99 %.1fus  p999 %.1fus  max %.1fus\n",
+           pct(0.5), pct(0.99), pct(0.999), pct(1));
+    if (delivered) {
+        printf("Bench CPU  %.2fus per delivered msg\n",
+               cpu / 1e3 / delivered);
+    }
+    if (server_pid && delivered) {
+        u64 scpu = cpu_ns(server_pid) - scpu0;
+        printf("Server CPU %.2fus per delivered msg (%.0f%% of a core)\n",
+               scpu / 1e3 / delivered, scpu / 1e7 / secs);
+    }
+    
+    for (int i = 0; i < conns_n; i++) {
+        close(conns[i].fd);
+        free(conns[i].in);
+    }
+    close(tfd);
+    close(ep);
+    free(conns);
+    free(samples);
+    free(frame);
+}
@@ -0,0 +1,300 @@
+/*******************************************************************************************
+*
+*   chacha20poly1305.h - ChaCha20, HChaCha20 and the ChaCha20-Poly1305 AEAD (RFC 8439)
+*
+*   Single-file, dependency-free, portable C99. Public domain / CC0.
+*
+*   USAGE:
+*       #define CHACHA20POLY1305_IMPLEMENTATION
+*       #include "chacha20poly1305.h"
+*
+*   in exactly one translation unit, include it without the define everywhere else.
+*
+*   API:
+*       cc20_xor()       - XOR len bytes with the ChaCha20 keystream, starting at a block counter
+*       hchacha20()      - derive a 32-byte subkey from a key and 16 bytes of input
+*       cc20p1305_seal() - encrypt and authenticate, may work in place
+*       cc20p1305_open() - verify and decrypt, may work in place, returns 0 on success
+*
+*   NOTES:
+*       - Poly1305 uses 26-bit limbs (after poly1305-donna), no 128-bit integers needed
+*       - The tag comparison runs in constant time
+*       - No attempt is made to wipe secrets from the stack
+*
+*******************************************************************************************/
+
+#ifndef CHACHA20POLY1305_H
+#define CHACHA20POLY1305_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CC20_KEY_SIZE   32
+#define CC20_NONCE_SIZE 12
+#define POLY1305_TAG_SIZE 16
+
+void cc20_xor(uint8_t *out, const uint8_t *in, size_t len,
+              const uint8_t key[32], uint32_t counter, const uint8_t nonce[12]);
+void hchacha20(uint8_t out[32], const uint8_t key[32], const uint8_t in[16]);
+void cc20p1305_seal(uint8_t *ct, uint8_t tag[16], const uint8_t *pt, size_t len,
+                    const uint8_t *ad, size_t adlen,
+                    const uint8_t key[32], const uint8_t nonce[12]);
+int cc20p1305_open(uint8_t *pt, const uint8_t *ct, size_t len, const uint8_t tag[16],
+                   const uint8_t *ad, size_t adlen,
+                   const uint8_t key[32], const uint8_t nonce[12]);
+
+#endif // CHACHA20POLY1305_H
+
+/***********************************************************************************
+*
+*   CHACHA20POLY1305 IMPLEMENTATION
+*
+************************************************************************************/
+
+#if defined(CHACHA20POLY1305_IMPLEMENTATION)
+
+#include <string.h>
+
+static uint32_t cc20_ld32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+        ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void cc20_st32(uint8_t *p, uint32_t v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static void cc20_st64(uint8_t *p, uint64_t v) {
+    cc20_st32(p, (uint32_t)v);
+    cc20_st32(p+4, (uint32_t)(v >> 32));
+}
+
+//----------------------------------------------------------------------------------
+// ChaCha20
+//----------------------------------------------------------------------------------
+
+#define CC20_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define CC20_QR(a, b, c, d) \
+    a += b; d ^= a; d = CC20_ROTL(d, 16); \
+    c += d; b ^= c; b = CC20_ROTL(b, 12); \
+    a += b; d ^= a; d = CC20_ROTL(d, 8);  \
+    c += d; b ^= c; b = CC20_ROTL(b, 7);
+
+static void cc20_rounds(uint32_t x[16]) {
+    for (int i = 0; i < 10; i++) {
+        CC20_QR(x[0], x[4], x[8],  x[12]);
+        CC20_QR(x[1], x[5], x[9],  x[13]);
+        CC20_QR(x[2], x[6], x[10], x[14]);
+        CC20_QR(x[3], x[7], x[11], x[15]);
+        CC20_QR(x[0], x[5], x[10], x[15]);
+        CC20_QR(x[1], x[6], x[11], x[12]);
+        CC20_QR(x[2], x[7], x[8],  x[13]);
+        CC20_QR(x[3], x[4], x[9],  x[14]);
+    }
+}
+
+// "expand 32-byte k"
+static void cc20_setup(uint32_t s[16], const uint8_t key[32]) {
+    s[0] = 0x61707865; s[1] = 0x3320646e; s[2] = 0x79622d32; s[3] = 0x6b206574;
+    for (int i = 0; i < 8; i++) s[4+i] = cc20_ld32(key + 4*i);
+}
+
+void cc20_xor(uint8_t *out, const uint8_t *in, size_t len,
+              const uint8_t key[32], uint32_t counter, const uint8_t nonce[12]) {
+    uint32_t s[16], x[16];
+    uint8_t ks[64];
+
+    cc20_setup(s, key);
+    s[12] = counter;
+    s[13] = cc20_ld32(nonce);
+    s[14] = cc20_ld32(nonce+4);
+    s[15] = cc20_ld32(nonce+8);
+
+    while (len) {
+        memcpy(x, s, sizeof(x));
+        cc20_rounds(x);
+        for (int i = 0; i < 16; i++) cc20_st32(ks + 4*i, x[i] + s[i]);
+
+        size_t n = len < 64 ? len : 64;
+        for (size_t i = 0; i < n; i++) out[i] = in[i] ^ ks[i];
+
+        out += n;
+        in += n;
+        len -= n;
+        s[12]++;
+    }
+}
+
+void hchacha20(uint8_t out[32], const uint8_t key[32], const uint8_t in[16]) {
+    uint32_t x[16];
+
+    cc20_setup(x, key);
+    for (int i = 0; i < 4; i++) x[12+i] = cc20_ld32(in + 4*i);
+
+    cc20_rounds(x);
+
+    for (int i = 0; i < 4; i++) {
+        cc20_st32(out + 4*i, x[i]);
+        cc20_st32(out + 16 + 4*i, x[12+i]);
+    }
+}
+
+//----------------------------------------------------------------------------------
+// Poly1305
+//----------------------------------------------------------------------------------
+
+typedef struct {
+    uint32_t r[5], h[5], pad[4];
+} Poly1305;
+
+static void poly1305_init(Poly1305 *st, const uint8_t key[32]) {
+    // Clamp r
+    st->r[0] = (cc20_ld32(key+0)) & 0x3ffffff;
+    st->r[1] = (cc20_ld32(key+3) >> 2) & 0x3ffff03;
+    st->r[2] = (cc20_ld32(key+6) >> 4) & 0x3ffc0ff;
+    st->r[3] = (cc20_ld32(key+9) >> 6) & 0x3f03fff;
+    st->r[4] = (cc20_ld32(key+12) >> 8) & 0x00fffff;
+
+    memset(st->h, 0, sizeof(st->h));
+    for (int i = 0; i < 4; i++) st->pad[i] = cc20_ld32(key + 16 + 4*i);
+}
+
+// Absorb whole 16-byte blocks
+static void poly1305_blocks(Poly1305 *st, const uint8_t *m, size_t blocks) {
+    const uint32_t hibit = 1 << 24;
+    uint32_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2], r3 = st->r[3], r4 = st->r[4];
+    uint32_t s1 = r1*5, s2 = r2*5, s3 = r3*5, s4 = r4*5;
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+
+    for (; blocks; blocks--, m += 16) {
+        h0 += (cc20_ld32(m+0)) & 0x3ffffff;
+        h1 += (cc20_ld32(m+3) >> 2) & 0x3ffffff;
+        h2 += (cc20_ld32(m+6) >> 4) & 0x3ffffff;
+        h3 += (cc20_ld32(m+9) >> 6) & 0x3ffffff;
+        h4 += (cc20_ld32(m+12) >> 8) | hibit;
+
+        uint64_t d0 = (uint64_t)h0*r0 + (uint64_t)h1*s4 + (uint64_t)h2*s3 + (uint64_t)h3*s2 + (uint64_t)h4*s1;
+        uint64_t d1 = (uint64_t)h0*r1 + (uint64_t)h1*r0 + (uint64_t)h2*s4 + (uint64_t)h3*s3 + (uint64_t)h4*s2;
+        uint64_t d2 = (uint64_t)h0*r2 + (uint64_t)h1*r1 + (uint64_t)h2*r0 + (uint64_t)h3*s4 + (uint64_t)h4*s3;
+        uint64_t d3 = (uint64_t)h0*r3 + (uint64_t)h1*r2 + (uint64_t)h2*r1 + (uint64_t)h3*r0 + (uint64_t)h4*s4;
+        uint64_t d4 = (uint64_t)h0*r4 + (uint64_t)h1*r3 + (uint64_t)h2*r2 + (uint64_t)h3*r1 + (uint64_t)h4*r0;
+
+        uint32_t c;
+        c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & 0x3ffffff;
+        d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3ffffff;
+        d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3ffffff;
+        d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3ffffff;
+        d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3ffffff;
+        h0 += c*5; c = h0 >> 26; h0 &= 0x3ffffff;
+        h1 += c;
+    }
+
+    st->h[0] = h0; st->h[1] = h1; st->h[2] = h2; st->h[3] = h3; st->h[4] = h4;
+}
+
+// Absorb data zero-padded to a multiple of 16 bytes
+static void poly1305_padded(Poly1305 *st, const uint8_t *m, size_t len) {
+    poly1305_blocks(st, m, len / 16);
+
+    size_t rest = len % 16;
+    if (rest) {
+        uint8_t block[16] = {0};
+        memcpy(block, m + len - rest, rest);
+        poly1305_blocks(st, block, 1);
+    }
+}
+
+static void poly1305_finish(Poly1305 *st, uint8_t mac[16]) {
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+    uint32_t c;
+
+    // Fully carry h
+    c = h1 >> 26; h1 &= 0x3ffffff;
+    h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+    h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+    h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+    h0 += c*5; c = h0 >> 26; h0 &= 0x3ffffff;
+    h1 += c;
+
+    // g = h - p
+    uint32_t g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+    uint32_t g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+    uint32_t g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+    uint32_t g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+    uint32_t g4 = h4 + c - (1UL << 26);
+
+    // Pick h if h < p, g otherwise, without branching
+    uint32_t mask = (g4 >> 31) - 1;
+    g0 &= mask; g1 &= mask; g2 &= mask; g3 &= mask; g4 &= mask;
+    mask = ~mask;
+    h0 = (h0 & mask) | g0;
+    h1 = (h1 & mask) | g1;
+    h2 = (h2 & mask) | g2;
+    h3 = (h3 & mask) | g3;
+    h4 = (h4 & mask) | g4;
+
+    // h %= 2^128
+    h0 = (h0      ) | (h1 << 26);
+    h1 = (h1 >>  6) | (h2 << 20);
+    h2 = (h2 >> 12) | (h3 << 14);
+    h3 = (h3 >> 18) | (h4 <<  8);
+
+    // mac = (h + pad) % 2^128
+    uint64_t f;
+    f = (uint64_t)h0 + st->pad[0];             h0 = (uint32_t)f;
+    f = (uint64_t)h1 + st->pad[1] + (f >> 32); h1 = (uint32_t)f;
+    f = (uint64_t)h2 + st->pad[2] + (f >> 32); h2 = (uint32_t)f;
+    f = (uint64_t)h3 + st->pad[3] + (f >> 32); h3 = (uint32_t)f;
+
+    cc20_st32(mac+0, h0);
+    cc20_st32(mac+4, h1);
+    cc20_st32(mac+8, h2);
+    cc20_st32(mac+12, h3);
+}
+
+//----------------------------------------------------------------------------------
+// AEAD
+//----------------------------------------------------------------------------------
+
+static void cc20p1305_tag(uint8_t tag[16], const uint8_t *ct, size_t len,
+                          const uint8_t *ad, size_t adlen,
+                          const uint8_t key[32], const uint8_t nonce[12]) {
+    // The one-time Poly1305 key is the first half of block 0
+    uint8_t otk[64] = {0};
+    cc20_xor(otk, otk, 64, key, 0, nonce);
+
+    Poly1305 st;
+    poly1305_init(&st, otk);
+    poly1305_padded(&st, ad, adlen);
+    poly1305_padded(&st, ct, len);
+
+    uint8_t lens[16];
+    cc20_st64(lens, adlen);
+    cc20_st64(lens+8, len);
+    poly1305_blocks(&st, lens, 1);
+
+    poly1305_finish(&st, tag);
+}
+
+void cc20p1305_seal(uint8_t *ct, uint8_t tag[16], const uint8_t *pt, size_t len,
+                    const uint8_t *ad, size_t adlen,
+                    const uint8_t key[32], const uint8_t nonce[12]) {
+    cc20_xor(ct, pt, len, key, 1, nonce);
+    cc20p1305_tag(tag, ct, len, ad, adlen, key, nonce);
+}
+
+int cc20p1305_open(uint8_t *pt, const uint8_t *ct, size_t len, const uint8_t tag[16],
+                   const uint8_t *ad, size_t adlen,
+                   const uint8_t key[32], const uint8_t nonce[12]) {
+    uint8_t want[16];
+    cc20p1305_tag(want, ct, len, ad, adlen, key, nonce);
+
+    uint8_t diff = 0;
+    for (int i = 0; i < 16; i++) diff |= want[i] ^ tag[i];
+    if (diff) return -1;
+
+    cc20_xor(pt, ct, len, key, 1, nonce);
+    return 0;
+}
+
+#endif // CHACHA20POLY1305_IMPLEMENTATION
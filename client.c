@@ -1,3 +1,8 @@
+#ifdef _WIN32
+// rand_s()
+#define _CRT_RAND_S
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,6 +11,14 @@
 #include <time.h>
 #include <stdint.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86
+#include <immintrin.h>
+#endif
+
+#define CHACHA20POLY1305_IMPLEMENTATION
+#include "chacha20poly1305.h"
+
 ////////////////////////////////
 
 #ifdef _WIN32
@@ -15,6 +28,8 @@
 #else
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <unistd.h>
+#define closesocket close
 #endif
 
 ////////////////////////////////
@@ -22,23 +37,74 @@
 typedef uint8_t byte;
 typedef uint16_t u16;
 typedef uint32_t u32;
+typedef uint64_t u64;
 
 #define prefix(s1, s2) (!strncmp(s1, s2, strlen(s2)))
 
 // NOTE(w): legacy, rework this
 #define T_USER 1
-//#define T_KEYSUM 0
+#define T_KEYSUM 0
+#define T_STREAM 2
 //#define T_BYE 3
+#define T_AEAD 4
+// Control frames for the server (T_KEYSUM too), never relayed
+#define T_JOIN 5
+#define T_LEAVE 6
+#define T_PART 7
 
 ////////////////////////////////
 // Message format
 // HEADER
-//   1b type
+//   1b type  (T_USER - legacy cypher, T_STREAM - stream cypher,
+//             T_AEAD - ChaCha20-Poly1305)
 //   1b nonce (used in encryption)
 //   2b len   (of the message)
 //   2b userid
 // BODY
 //   lenXb encrypted message
+// T_AEAD BODY
+//   8b session id
+//   8b counter
+//   (len-32)b encrypted message
+//   16b tag, the header is authenticated too
+// T_JOIN BODY
+//   lenXb room name, in the clear; only members of the
+//   same room get each other's messages. T_LEAVE (no body)
+//   goes back to the lobby, where everybody starts.
+// T_PART BODY, a slice of a message too long for one frame
+//   1b type of the whole message
+//   4b message id, random
+//   4b length of the whole body
+//   4b offset of this slice
+//   the slice
+//   The whole message is the usual header (with len 0) and
+//   body, encrypted as one before it is cut up. The server
+//   sends parts only when nothing else is waiting, so they
+//   don't hold up other messages.
+// T_KEYSUM BODY
+//   8b key fingerprint, sent right after connecting; the
+//   server only passes us messages from clients that sent
+//   the same one.
+
+#define AEAD_OVERHEAD 32
+
+#define PART_HDR 13
+#define PART_SIZE 16384
+// Longest message we send or put back together
+#define MAX_MESSAGE (16 << 20)
+
+// Frame type we send. T_USER is for peers older than
+// T_STREAM, T_AEAD for peers that know it.
+int cypher = T_STREAM;
+
+// Handle --legacy or --aead, for both clients. Returns 0 if
+// arg is something else.
+int cypher_option(const char *arg) {
+    if (!strcmp(arg, "--legacy")) cypher = T_USER;
+    else if (!strcmp(arg, "--aead")) cypher = T_AEAD;
+    else return 0;
+    return 1;
+}
 
 ////////////////////////////////
 // Helpers
@@ -75,6 +141,14 @@ u16 h16(byte *data) {
     return data[0] | ((u16)data[1] << 8);
 }
 
+u32 h32(byte *data) {
+    return h16(data) | ((u32)h16(data+2) << 16);
+}
+
+void put32(byte *data, u32 v) {
+    for (int i = 0; i < 4; i++) data[i] = v >> (8*i);
+}
+
 int parseip(const char *ip, u32 *addr, u16 *p) {
     byte a, b, c, d;
     u16 port;
@@ -188,6 +262,253 @@ byte *decrypt(byte *text,
     return text;
 }
 
+// The legacy cypher makes a pass over the rest of the message
+// for every byte, which takes seconds for long messages.
+// T_STREAM frames use a keystream that is computed once per
+// message and XORed over the text in a single pass.
+
+// Expand the key into keylen bytes of keystream for this nonce
+void keystream(byte *ks, const byte *key, size_t keylen, byte nonce) {
+    // FNV-1a of the key, seeded with the nonce
+    u32 h = 2166136261u ^ nonce;
+    for (size_t i = 0; i < keylen; i++) {
+        h ^= key[i];
+        h *= 16777619u;
+    }
+    if (h == 0) h = 1;
+    
+    for (size_t i = 0; i < keylen; i++) {
+        // xorshift32
+        h ^= h << 13;
+        h ^= h >> 17;
+        h ^= h << 5;
+        ks[i] = key[i] ^ (h >> 24);
+    }
+}
+
+////////////////////////////////
+// XOR kernels, dst[i] ^= src[i]
+// The best one for this CPU is picked on first use.
+
+void xor_scalar(byte *dst, const byte *src, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, dst+i, 8);
+        memcpy(&b, src+i, 8);
+        a ^= b;
+        memcpy(dst+i, &a, 8);
+    }
+    for (; i < n; i++) dst[i] ^= src[i];
+}
+
+#ifdef HAVE_X86
+__attribute__((target("sse2")))
+void xor_sse2(byte *dst, const byte *src, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(dst+i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src+i));
+        _mm_storeu_si128((__m128i*)(dst+i), _mm_xor_si128(a, b));
+    }
+    xor_scalar(dst+i, src+i, n-i);
+}
+
+__attribute__((target("avx2")))
+void xor_avx2(byte *dst, const byte *src, size_t n) {
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i*)(dst+i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i*)(dst+i+32));
+        __m256i b0 = _mm256_loadu_si256((const __m256i*)(src+i));
+        __m256i b1 = _mm256_loadu_si256((const __m256i*)(src+i+32));
+        _mm256_storeu_si256((__m256i*)(dst+i), _mm256_xor_si256(a0, b0));
+        _mm256_storeu_si256((__m256i*)(dst+i+32), _mm256_xor_si256(a1, b1));
+    }
+    xor_sse2(dst+i, src+i, n-i);
+}
+#endif
+
+typedef void (*XorFn)(byte *dst, const byte *src, size_t n);
+
+XorFn pick_xor(void) {
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return xor_avx2;
+    if (__builtin_cpu_supports("sse2")) return xor_sse2;
+#endif
+    return xor_scalar;
+}
+
+void xorbytes(byte *dst, const byte *src, size_t n) {
+    static XorFn fn = NULL;
+    if (fn == NULL) fn = pick_xor();
+    fn(dst, src, n);
+}
+
+// Keystream blocks are at least this long, so the kernels
+// get to run on full vectors even with short keys
+#define KS_BLOCK 512
+
+// Encrypts and decrypts alike
+byte *streamcrypt(byte *text,
+                  size_t len,
+                  byte *key,
+                  byte nonce) {
+    size_t keylen = strlen((char*)key);
+    
+    assert(keylen > 0);
+    
+    // Repeat the keystream to a whole number of periods, then
+    // XOR the text one block at a time
+    size_t periods = (KS_BLOCK + keylen - 1) / keylen;
+    size_t blklen = periods * keylen;
+    
+    // Kept between calls, the key rarely changes. The GUI
+    // client encrypts and decrypts on different threads.
+    static _Thread_local byte *blk = NULL;
+    static _Thread_local size_t blkcap = 0;
+    if (blklen > blkcap) {
+        blk = realloc(blk, blklen);
+        blkcap = blklen;
+    }
+    
+    keystream(blk, key, keylen, nonce);
+    for (size_t p = 1; p < periods; p++) {
+        memcpy(blk + p*keylen, blk, keylen);
+    }
+    
+    for (size_t i = 0; i < len; i += blklen) {
+        size_t n = len - i < blklen ? len - i : blklen;
+        xorbytes(text+i, blk, n);
+    }
+    
+    return text;
+}
+
+////////////////////////////////
+// Authenticated encryption
+// The preshared key is condensed into a master key once.
+// Every client run picks a random session id and encrypts
+// with a key derived from the master key and that id, so
+// the 64-bit counter nonce never repeats under one key.
+
+byte master[32];
+int have_master = 0;
+
+byte my_sid[8], my_key[32];
+u64 my_ctr = 0;
+
+// Keys of the sessions we have heard from lately
+#define SESSIONS 16
+struct {
+    byte sid[8], key[32];
+    int used;
+} sessions[SESSIONS];
+
+void randbytes(byte *buf, size_t len) {
+#ifdef _WIN32
+    for (size_t i = 0; i < len; i++) {
+        unsigned int v;
+        rand_s(&v);
+        buf[i] = v;
+    }
+#else
+    FILE *f = fopen("/dev/urandom", "rb");
+    if (f == NULL || fread(buf, 1, len, f) != len) {
+        perror("/dev/urandom");
+        exit(1);
+    }
+    fclose(f);
+#endif
+}
+
+// Chain HChaCha20 over the key in 16-byte blocks, finishing
+// with a block that holds the length
+void derive_master(const char *key) {
+    size_t keylen = strlen(key);
+    byte k[32] = {0}, block[16];
+    
+    for (size_t i = 0; i < keylen; i += 16) {
+        memset(block, 0, 16);
+        memcpy(block, key+i, keylen-i < 16 ? keylen-i : 16);
+        hchacha20(k, k, block);
+    }
+    
+    memset(block, 0, 16);
+    memcpy(block, "chat-kdf", 8);
+    for (int i = 0; i < 8; i++) block[8+i] = (u64)keylen >> (8*i);
+    hchacha20(master, k, block);
+    
+    have_master = 1;
+}
+
+void session_key(byte *out, const byte *sid) {
+    byte block[16] = {0};
+    memcpy(block, sid, 8);
+    memcpy(block+8, "session", 7);
+    hchacha20(out, master, block);
+}
+
+void aead_setup(const char *key) {
+    if (have_master) return;
+    derive_master(key);
+    randbytes(my_sid, 8);
+    session_key(my_key, my_sid);
+}
+
+// Derived from the master key like the session keys, so it
+// doesn't help with guessing the key any more than the
+// messages themselves
+void keysum(byte *out, const char *key) {
+    byte block[16] = {0}, sum[32];
+    aead_setup(key);
+    memcpy(block, "keysum", 6);
+    hchacha20(sum, master, block);
+    memcpy(out, sum, 8);
+}
+
+// Nonce is 4 zero bytes and the counter
+void aead_nonce(byte *nonce, const byte *ctr) {
+    memset(nonce, 0, 4);
+    memcpy(nonce+4, ctr, 8);
+}
+
+// Fill in the body of a T_AEAD frame, the header must be
+// complete already. len is the length of the plain text.
+void aead_seal(byte *frame, const char *msg, size_t len) {
+    byte *body = frame+6, nonce[12];
+    
+    memcpy(body, my_sid, 8);
+    for (int i = 0; i < 8; i++) body[8+i] = my_ctr >> (8*i);
+    my_ctr++;
+    
+    aead_nonce(nonce, body+8);
+    cc20p1305_seal(body+16, body+16+len, (const byte*)msg, len,
+                   frame, 6, my_key, nonce);
+}
+
+// Decrypt a T_AEAD frame in place. On success the plain text
+// starts 16 bytes into the body.
+int aead_open(byte *frame, size_t len) {
+    if (len < AEAD_OVERHEAD) return -1;
+    
+    byte *body = frame+6, nonce[12];
+    size_t msglen = len - AEAD_OVERHEAD;
+    
+    // The session table is small, a key costs one block to derive
+    int slot = body[0] % SESSIONS;
+    if (!sessions[slot].used || memcmp(sessions[slot].sid, body, 8)) {
+        memcpy(sessions[slot].sid, body, 8);
+        session_key(sessions[slot].key, body);
+        sessions[slot].used = 1;
+    }
+    
+    aead_nonce(nonce, body+8);
+    return cc20p1305_open(body+16, body+16, msglen, body+16+msglen,
+                          frame, 6, sessions[slot].key, nonce);
+}
+
 
 ////////////////////////////////
 
@@ -198,121 +519,316 @@ void dosend(int fd, byte *data, size_t len) {
     }
 }
 
-void sendmessage(int fd, char *userid, char *msg, char *key, byte nonce) {
-    byte hdr[6];
+// Cut an encrypted message with a len byte body into T_PART
+// frames
+void sendparts(int fd, byte *data, size_t len) {
+    byte part[6+PART_HDR+PART_SIZE], id[4];
+    randbytes(id, 4);
     
+    for (size_t off = 0; off < len; off += PART_SIZE) {
+        size_t n = len-off < PART_SIZE ? len-off : PART_SIZE;
+        
+        part[0] = T_PART;
+        part[1] = data[1];
+        part[2] = (PART_HDR+n) & 0xFF;
+        part[3] = ((PART_HDR+n) & 0xFF00) >> 8;
+        part[4] = data[4];
+        part[5] = data[5];
+        part[6] = data[0];
+        memcpy(part+7, id, 4);
+        put32(part+11, len);
+        put32(part+15, off);
+        memcpy(part+6+PART_HDR, data+6+off, n);
+        
+        dosend(fd, part, 6+PART_HDR+n);
+    }
+}
+
+void sendmessage(int fd, char *userid, char *msg, char *key, byte nonce) {
     size_t msglen = strlen(msg);
     
     assert(msglen);
     
-    if (msglen > 65535) {
+    size_t extra = cypher == T_AEAD ? AEAD_OVERHEAD : 0;
+    // Peers of the legacy cypher don't know T_PART
+    size_t max = cypher == T_USER ? 65535 : MAX_MESSAGE;
+    
+    if (msglen + extra > max) {
         printf("Your message is too long\n"
                "It is going to be cropped\n");
-        msglen = 65535;
+        msglen = max - extra;
     }
     
-    hdr[0] = T_USER;
-    hdr[1] = nonce;
-    hdr[2] = msglen & 0xFF;
-    hdr[3] = (msglen & 0xFF00) >> 8;
-    hdr[4] = userid[0];
-    hdr[5] = userid[1];
+    size_t len = msglen + extra;
+    
+    // Header and body go out in a single send()
+    byte *data = malloc(6+len);
+    
+    data[0] = cypher;
+    data[1] = nonce;
+    data[2] = len > 65535 ? 0 : len & 0xFF;
+    data[3] = len > 65535 ? 0 : (len & 0xFF00) >> 8;
+    data[4] = userid[0];
+    data[5] = userid[1];
+    
+    switch (cypher) {
+    case T_USER:
+        memcpy(data+6, msg, msglen);
+        encrypt(data+6, msglen, (byte*)key, nonce);
+        break;
+    case T_STREAM:
+        memcpy(data+6, msg, msglen);
+        streamcrypt(data+6, msglen, (byte*)key, nonce);
+        break;
+    case T_AEAD:
+        aead_setup(key);
+        aead_seal(data, msg, msglen);
+        break;
+    }
+    
+    if (len <= 65535) dosend(fd, data, 6+len);
+    else sendparts(fd, data, len);
+    free(data);
+}
+
+// Send a control frame, the body is at most 255 bytes
+void sendcontrol(int fd, byte type, char *userid, const void *body, size_t len) {
+    byte data[6+255];
     
-    dosend(fd, hdr, 6);
+    if (len > 255) len = 255;
+    data[0] = type;
+    data[1] = 0;
+    data[2] = len;
+    data[3] = 0;
+    data[4] = userid[0];
+    data[5] = userid[1];
+    if (len) memcpy(data+6, body, len);
     
-    encrypt((byte*)msg, msglen, (byte*)key, nonce);
+    dosend(fd, data, 6+len);
+}
+
+// Tell the server which key we use. Clients older than
+// T_KEYSUM don't, so --legacy doesn't either and stays
+// with them.
+void announce(int fd, char *userid, char *key) {
+    if (cypher == T_USER) return;
     
-    dosend(fd, (byte*)msg, msglen);
+    byte sum[8];
+    keysum(sum, key);
+    sendcontrol(fd, T_KEYSUM, userid, sum, 8);
+}
+
+// Handle /join <room> and /leave, returns 1 if msg was one
+int command(int fd, char *userid, char *msg) {
+    if (prefix(msg, "/join ")) {
+        msg += strlen("/join ");
+        sendcontrol(fd, T_JOIN, userid, msg, strlen(msg));
+        return 1;
+    }
+    if (!strcmp(msg, "/leave")) {
+        sendcontrol(fd, T_LEAVE, userid, NULL, 0);
+        return 1;
+    }
+    return 0;
 }
 
 ////////////////////////////////
 
-// Receive one message from fd
-byte *receive(int fd, size_t *sz) {
+// Bytes read from the server that haven't been handled yet.
+// Frames are parsed and decrypted right in this buffer, only
+// the history copies what it keeps.
+// It always has room for a whole frame after compaction.
+#define RBUF_SIZE (256*1024)
+byte rbuf[RBUF_SIZE];
+size_t rbuf_head = 0, rbuf_tail = 0;
+
+// Read whatever fd has, returns what recv() did
+ssize_t receive(int fd) {
     assert(fd >= 0);
     
-    byte buf[128];
-    byte *data = NULL;
-    ssize_t res = 0;
+    // Move the unfinished frame to the front
+    if (RBUF_SIZE - rbuf_tail < 6+65535) {
+        memmove(rbuf, rbuf+rbuf_head, rbuf_tail-rbuf_head);
+        rbuf_tail -= rbuf_head;
+        rbuf_head = 0;
+    }
+    
+    ssize_t res = recv(fd, (char*)rbuf+rbuf_tail, RBUF_SIZE-rbuf_tail, 0);
+    if (res > 0) rbuf_tail += res;
+    return res;
+}
+
+// Next complete frame in the read buffer, NULL if there's none
+byte *next_frame(size_t *sz) {
+    size_t avail = rbuf_tail - rbuf_head;
+    byte *data = rbuf+rbuf_head;
+    
+    // Haven't received the header yet
+    if (avail < 6) return NULL;
+    // Haven't received the full message length
+    *sz = h16(data+2)+(size_t)6;
+    if (avail < *sz) return NULL;
+    
+    rbuf_head += *sz;
+    if (rbuf_head == rbuf_tail) rbuf_head = rbuf_tail = 0;
+    return data;
+}
+
+// Frames for the server only, nothing to decrypt or show
+int is_control(byte type) {
+    return type == T_KEYSUM || type == T_JOIN || type == T_LEAVE;
+}
+
+// Decrypt a frame in place and point text at the message
+void decode(byte *data, size_t sz, char *key, byte **text, size_t *len) {
+    byte nonce = data[1];
     
-    *sz = 0;
+    *text = data+6;
+    *len = sz-6;
     
-    while (1) {
-        if ((res = recv(fd, buf, 128, 0)) < 0) {
-            sockperror("recv()");
-            exit(1);
+    if (data[0] == T_AEAD) {
+        aead_setup(key);
+        if (aead_open(data, *len) < 0) {
+            static char bad[] = "<message failed authentication>";
+            *text = (byte*)bad;
+            *len = sizeof(bad)-1;
         }
-        // The connection was closed (gracefully)
-        if (res == 0) {
-            printf("The server has disconnected\n");
-            exit(1);
+        else {
+            *text = data+6+16;
+            *len -= AEAD_OVERHEAD;
         }
-        *sz += res;
-        // Append the data
-        data = realloc(data, *sz);
-        memcpy(data+*sz-res, buf, res);
-        // Haven't received the header yet
-        if (*sz < 6) continue;
-        // Haven't received the full message length
-        if (*sz < (size_t)(h16(data+2)+(u16)6)) continue;
-        break;
     }
+    else if (data[0] == T_STREAM) streamcrypt(*text, *len, (byte*)key, nonce);
+    else decrypt(*text, *len, (byte*)key, nonce);
+}
+
+// Messages arriving in parts. Parts of one message come in
+// order, but several may be under way at once.
+#define PARTIALS 8
+struct {
+    byte *data;
+    u32 id;
+    size_t len, got;
+    u64 used;
+} partials[PARTIALS];
+u64 partials_clock = 0;
+
+// Add a T_PART frame to its message. Once the last part is
+// in, returns the whole message as a frame for decode(),
+// which the caller frees, and its size in sz.
+byte *part_add(byte *frame, size_t fsz, size_t *sz) {
+    if (fsz < 6+PART_HDR) return NULL;
     
+    byte *body = frame+6;
+    u32 id = h32(body+1);
+    size_t len = h32(body+5), off = h32(body+9), n = fsz-6-PART_HDR;
+    if (len > MAX_MESSAGE || off > len || n > len-off) return NULL;
+    
+    int slot = -1;
+    for (int i = 0; i < PARTIALS; i++) {
+        if (partials[i].data && partials[i].id == id &&
+            !memcmp(partials[i].data+4, frame+4, 2)) slot = i;
+    }
+    
+    if (slot < 0) {
+        // We joined in the middle of it
+        if (off != 0) return NULL;
+        
+        // Take a free slot, or the one idle the longest
+        slot = 0;
+        for (int i = 0; i < PARTIALS; i++) {
+            if (partials[i].data == NULL) {
+                slot = i;
+                break;
+            }
+            if (partials[i].used < partials[slot].used) slot = i;
+        }
+        free(partials[slot].data);
+        
+        byte *data = malloc(6+len);
+        data[0] = body[0];
+        data[1] = frame[1];
+        data[2] = data[3] = 0;
+        memcpy(data+4, frame+4, 2);
+        
+        partials[slot].data = data;
+        partials[slot].id = id;
+        partials[slot].len = len;
+        partials[slot].got = 0;
+    }
+    // Another peer may reuse the id, only trust the length
+    // the buffer was allocated for
+    else if (len != partials[slot].len) return NULL;
+    if (off > partials[slot].len || n > partials[slot].len-off) return NULL;
+    
+    // A part got lost, the server sheds frames for slow peers
+    if (off != partials[slot].got) {
+        free(partials[slot].data);
+        partials[slot].data = NULL;
+        return NULL;
+    }
+    
+    memcpy(partials[slot].data+6+off, body+PART_HDR, n);
+    partials[slot].got += n;
+    partials[slot].used = ++partials_clock;
+    if (partials[slot].got < len) return NULL;
+    
+    byte *data = partials[slot].data;
+    partials[slot].data = NULL;
+    *sz = 6+len;
     return data;
 }
 
+#ifndef GUI_CLIENT
 // Receive all messages and print them
-void receive_all_and_print(int fd, char *key
-#ifdef GUI_CLIENT
-                           , char ***msgs,
-                           int *msgs_n
-#endif
-                           ) {
+void receive_all_and_print(int fd, char *key) {
     while (1) {
-        fd_set readfs;
-        FD_ZERO(&readfs);
-        FD_SET(fd, &readfs);
-        
-        struct timeval timeout = {0};
-        
-        int ret = select(fd+1, &readfs, NULL, NULL, &timeout);
-        
-        // Nothing to receive
-        if (ret == -1 || !FD_ISSET(fd, &readfs)) break;
-        
         size_t sz;
-        byte *data = receive(fd, &sz);
+        byte *data = next_frame(&sz);
         
-        if (sz < 6) {
-            printf("Malformed message received\n");
-            free(data);
-            break;
+        if (data == NULL) {
+            fd_set readfs;
+            FD_ZERO(&readfs);
+            FD_SET(fd, &readfs);
+            
+            struct timeval timeout = {0};
+            
+            int ret = select(fd+1, &readfs, NULL, NULL, &timeout);
+            
+            // Nothing to receive
+            if (ret == -1 || !FD_ISSET(fd, &readfs)) break;
+            
+            ssize_t res = receive(fd);
+            if (res < 0) {
+                sockperror("recv()");
+                exit(1);
+            }
+            // The connection was closed (gracefully)
+            if (res == 0) {
+                printf("The server has disconnected\n");
+                exit(1);
+            }
+            continue;
         }
         
-        size_t len = sz-6;
-        byte nonce = data[1];
-        char *id = (char*)data+4;
-        
-        decrypt(data+6, len, (byte*)key, nonce);
-        
-        char msg[len+1];
-        memcpy(msg, data+6, len);
-        msg[len] = 0;
+        if (is_control(data[0])) continue;
         
-#ifndef GUI_CLIENT
-        printf("[%c%c] %s\n", id[0], id[1], msg);
-#else
-        char *fullmsg = malloc(len+5+1);
-        snprintf(fullmsg, len+5+1, "[%c%c] %s", id[0], id[1], msg);
+        byte *whole = NULL;
+        if (data[0] == T_PART) {
+            whole = data = part_add(data, sz, &sz);
+            if (data == NULL) continue;
+        }
         
-        (*msgs_n)++;
-        *msgs = realloc(*msgs, sizeof(char*)*(*msgs_n));
-        (*msgs)[*msgs_n-1] = fullmsg;
-#endif
+        byte *text;
+        size_t len;
+        char *id = (char*)data+4;
         
-        free(data);
+        decode(data, sz, key, &text, &len);
+        printf("[%c%c] %.*s\n", id[0], id[1], (int)len, text);
+        free(whole);
     }
 }
+#endif
 
 ////////////////////////////////
 
@@ -325,9 +841,57 @@ void intrhandle(int _sig) {
 ////////////////////////////////
 
 #ifndef GUI_CLIENT
+// Throughput of every cypher on one message size
+void cypherbench(size_t len) {
+    char *key = "correct horse battery staple";
+    byte *buf = calloc(1, len + AEAD_OVERHEAD + 6);
+    char *msg = calloc(1, len);
+    const char *names[] = { "legacy", "stream", "aead" };
+    
+    aead_setup(key);
+    printf("%6zu bytes:", len);
+    
+    for (int c = 0; c < 3; c++) {
+        size_t iters = 0;
+        clock_t start = clock(), now;
+        
+        // Run for at least 0.2s
+        do {
+            switch (c) {
+            case 0: encrypt(buf+6, len, (byte*)key, 1); break;
+            case 1: streamcrypt(buf+6, len, (byte*)key, 1); break;
+            case 2: aead_seal(buf, msg, len); break;
+            }
+            iters++;
+            now = clock();
+        } while (now - start < CLOCKS_PER_SEC/5);
+        
+        double secs = (double)(now - start) / CLOCKS_PER_SEC;
+        printf("  %s %9.2f MB/s", names[c], len * iters / secs / 1e6);
+    }
+    
+    printf("\n");
+    free(buf);
+    free(msg);
+}
+
 int main(int argc, char **argv) {
+    if (argc == 2 && !strcmp(argv[1], "--cypher-bench")) {
+        size_t sizes[] = { 64, 1024, 16384, 65535 - AEAD_OVERHEAD };
+        for (int i = 0; i < 4; i++) cypherbench(sizes[i]);
+        return 0;
+    }
+    
+    while (argc > 2 && cypher_option(argv[1])) {
+        argv++;
+        argc--;
+    }
+    
     if (argc != 2) {
-        printf("Provide the ip and port of the server\n");
+        printf("Provide the ip and port of the server\n"
+               "Pass --legacy first to talk to old clients,\n"
+               "or --aead for authenticated encryption\n"
+               "--cypher-bench measures encryption speed\n");
         return 1;
     }
     
@@ -372,6 +936,7 @@ int main(int argc, char **argv) {
     }
     
     printf("Connection to server has been established\n");
+    announce(fd, userid, key);
     
     ////////////////////////////////
     // Main loop
@@ -405,6 +970,11 @@ int main(int argc, char **argv) {
         
         ////////////////////////////////
         
+        if (command(fd, userid, line)) {
+            free(line);
+            continue;
+        }
+        
         nonce++;
         sendmessage(fd, userid, line, key, nonce);
         
@@ -429,6 +999,719 @@ int main(int argc, char **argv) {
 
 #define RELRECT(x,y,w,h) (Rectangle){x*GetScreenWidth(), y*GetScreenHeight(), w*GetScreenWidth(), h*GetScreenHeight()}
 
+#include <stdarg.h>
+#include <stdatomic.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+////////////////////////////////
+// Message queue
+// The network thread decodes messages straight into this
+// buffer and the render loop takes them from it. Single
+// producer, single consumer, head and tail only grow.
+// A record is a u32 length and the NUL-terminated text,
+// padded to 4 bytes. Records don't wrap, MQ_WRAP marks the
+// unused end of the buffer.
+
+#define MQ_SIZE (1024*1024)
+#define MQ_WRAP 0xFFFFFFFFu
+
+byte mq_buf[MQ_SIZE];
+_Alignas(64) atomic_size_t mq_head;
+_Alignas(64) atomic_size_t mq_tail;
+
+// Set while the UI is tearing the connection down
+atomic_int net_stopping;
+
+void nap(void) {
+#ifdef _WIN32
+    Sleep(1);
+#else
+    usleep(1000);
+#endif
+}
+
+size_t mq_reclen(size_t len) {
+    return (4 + len+1 + 3) & ~(size_t)3;
+}
+
+// Room for len bytes of text, waits while the queue is full.
+// NULL if the connection is going away meanwhile.
+char *mq_reserve(size_t len) {
+    size_t need = mq_reclen(len);
+    size_t tail = atomic_load_explicit(&mq_tail, memory_order_relaxed);
+    
+    while (1) {
+        size_t head = atomic_load_explicit(&mq_head, memory_order_acquire);
+        size_t off = tail % MQ_SIZE, end = MQ_SIZE - off;
+        size_t skip = end < need ? end : 0;
+        
+        if (MQ_SIZE - (tail - head) >= skip + need) {
+            if (skip) {
+                u32 wrap = MQ_WRAP;
+                memcpy(mq_buf+off, &wrap, 4);
+                tail += skip;
+                atomic_store_explicit(&mq_tail, tail, memory_order_release);
+                off = 0;
+            }
+            u32 l = len;
+            memcpy(mq_buf+off, &l, 4);
+            return (char*)mq_buf+off+4;
+        }
+        
+        if (atomic_load(&net_stopping)) return NULL;
+        nap();
+    }
+}
+
+void mq_commit(size_t len) {
+    size_t tail = atomic_load_explicit(&mq_tail, memory_order_relaxed);
+    atomic_store_explicit(&mq_tail, tail + mq_reclen(len), memory_order_release);
+}
+
+void mq_put(const char *fmt, ...) {
+    va_list ap;
+    
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    
+    char *rec = mq_reserve(len);
+    if (rec == NULL) return;
+    
+    va_start(ap, fmt);
+    vsnprintf(rec, len+1, fmt, ap);
+    va_end(ap);
+    
+    mq_commit(len);
+}
+
+// Oldest message in the queue, NULL if it's empty
+char *mq_peek(void) {
+    size_t head = atomic_load_explicit(&mq_head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&mq_tail, memory_order_acquire);
+    
+    if (head == tail) return NULL;
+    
+    u32 l;
+    memcpy(&l, mq_buf + head%MQ_SIZE, 4);
+    if (l == MQ_WRAP) {
+        head += MQ_SIZE - head%MQ_SIZE;
+        atomic_store_explicit(&mq_head, head, memory_order_release);
+        if (head == tail) return NULL;
+    }
+    
+    return (char*)mq_buf + head%MQ_SIZE + 4;
+}
+
+void mq_pop(void) {
+    size_t head = atomic_load_explicit(&mq_head, memory_order_relaxed);
+    u32 l;
+    memcpy(&l, mq_buf + head%MQ_SIZE, 4);
+    atomic_store_explicit(&mq_head, head + mq_reclen(l), memory_order_release);
+}
+
+int mq_empty(void) {
+    return atomic_load_explicit(&mq_head, memory_order_relaxed)
+        == atomic_load_explicit(&mq_tail, memory_order_acquire);
+}
+
+// An idle render loop sleeps in mq_wait() until the network
+// thread signals new messages
+#ifdef _WIN32
+HANDLE mq_event;
+#else
+pthread_mutex_t mq_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t mq_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+void mq_signal(void) {
+#ifdef _WIN32
+    SetEvent(mq_event);
+#else
+    pthread_mutex_lock(&mq_lock);
+    pthread_cond_signal(&mq_cond);
+    pthread_mutex_unlock(&mq_lock);
+#endif
+}
+
+// Wait up to ms milliseconds for a message
+void mq_wait(int ms) {
+#ifdef _WIN32
+    if (mq_event == NULL) Sleep(ms);
+    else if (mq_empty()) WaitForSingleObject(mq_event, ms);
+#else
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += ms * 1000000L;
+    until.tv_sec += until.tv_nsec / 1000000000L;
+    until.tv_nsec %= 1000000000L;
+    
+    pthread_mutex_lock(&mq_lock);
+    if (mq_empty()) pthread_cond_timedwait(&mq_cond, &mq_lock, &until);
+    pthread_mutex_unlock(&mq_lock);
+#endif
+}
+
+////////////////////////////////
+// History
+// Messages are packed into big chunks, text growing from the
+// front and the offsets of the messages from the back. The
+// chunks sit in a ring, so adding a message and dropping the
+// oldest chunk once the history outgrows its cap are O(1).
+// Messages are numbered from the first one ever added.
+
+#define CHUNK_SIZE (256*1024)
+
+typedef struct Chunk Chunk;
+struct Chunk {
+    size_t first;   // number of the first message in here
+    u32 n;
+    u32 used;
+    u32 size;
+    byte data[];
+};
+
+typedef struct History History;
+struct History {
+    Chunk **chunks;
+    size_t chunks_cap, chunks_head, chunks_n;
+    size_t first, end;  // numbers of the messages we still have
+    size_t bytes, cap;
+    Chunk *spare;       // the last chunk dropped, reused next
+};
+
+void history_init(History *h, size_t cap) {
+    memset(h, 0, sizeof(History));
+    h->cap = cap;
+    // Chunks are never smaller than CHUNK_SIZE
+    h->chunks_cap = cap/CHUNK_SIZE + 2;
+    h->chunks = calloc(h->chunks_cap, sizeof(Chunk*));
+}
+
+Chunk *history_chunk(History *h, size_t k) {
+    return h->chunks[(h->chunks_head + k) % h->chunks_cap];
+}
+
+void history_drop(History *h) {
+    Chunk *c = history_chunk(h, 0);
+    
+    h->chunks_head = (h->chunks_head + 1) % h->chunks_cap;
+    h->chunks_n--;
+    h->bytes -= c->size;
+    h->first = h->chunks_n ? history_chunk(h, 0)->first : h->end;
+    
+    if (c->size == CHUNK_SIZE && h->spare == NULL) h->spare = c;
+    else free(c);
+}
+
+void history_add(History *h, const char *text) {
+    u32 len = strlen(text)+1;
+    Chunk *c = h->chunks_n ? history_chunk(h, h->chunks_n-1) : NULL;
+    
+    if (c == NULL || c->size - c->used - 4*c->n < len + 4) {
+        u32 size = CHUNK_SIZE;
+        if (len + 4 > size) size = (len + 4 + 3) & ~3u;
+        
+        while (h->chunks_n && (h->chunks_n == h->chunks_cap || h->bytes + size > h->cap))
+            history_drop(h);
+        
+        if (size == CHUNK_SIZE && h->spare) {
+            c = h->spare;
+            h->spare = NULL;
+        }
+        else c = malloc(sizeof(Chunk) + size);
+        
+        c->first = h->end;
+        c->n = 0;
+        c->used = 0;
+        c->size = size;
+        
+        h->chunks[(h->chunks_head + h->chunks_n) % h->chunks_cap] = c;
+        h->chunks_n++;
+        h->bytes += size;
+    }
+    
+    memcpy(c->data + c->used, text, len);
+    memcpy(c->data + c->size - 4*(c->n+1), &c->used, 4);
+    c->used += len;
+    c->n++;
+    h->end++;
+}
+
+// Message number i, NULL if it was dropped
+const char *history_get(History *h, size_t i) {
+    if (i < h->first || i >= h->end) return NULL;
+    
+    // Last chunk that starts at or before i
+    size_t lo = 0, hi = h->chunks_n;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (history_chunk(h, mid)->first <= i) lo = mid;
+        else hi = mid;
+    }
+    
+    Chunk *c = history_chunk(h, lo);
+    u32 off;
+    memcpy(&off, c->data + c->size - 4*(i - c->first + 1), 4);
+    return (char*)c->data + off;
+}
+
+////////////////////////////////
+// History view
+// Messages are wrapped to the width of the view. Only the
+// messages on screen get laid out, and their layouts are
+// kept until the width or the text size changes. The view is
+// anchored to a line of a message at its bottom edge, so
+// scrolling costs the same however long the history is.
+// A layout is the message already shaped: the glyph of every
+// codepoint and where it goes on its line. The view itself is
+// drawn into a texture that is only redrawn when something
+// on it changed.
+
+#define LAYOUT_CACHE 256
+
+typedef struct Layout Layout;
+struct Layout {
+    size_t msg;
+    u32 gen;
+    u32 lines;
+    u32 *starts;    // first glyph of every line, and one past the end
+    u32 starts_cap;
+    u16 *glyphs;
+    float *xs;
+    u32 glyphs_cap;
+};
+
+typedef struct View View;
+struct View {
+    Rectangle bounds;
+    float size, spacing, line_h;
+    u32 gen;
+    int index[128]; // ASCII glyphs of this font
+    float adv[128];
+    
+    // Bottom row shows line `line` of message `msg`
+    size_t msg;
+    u32 line;
+    int follow;     // stay on the newest message
+    
+    // What the texture shows
+    RenderTexture2D rt;
+    size_t drawn_first, drawn_end, drawn_msg;
+    u32 drawn_line, drawn_gen;
+    
+    Layout cache[LAYOUT_CACHE];
+};
+
+void view_init(View *v) {
+    memset(v, 0, sizeof(View));
+    v->gen = 1;
+    v->follow = 1;
+}
+
+// Glyph and advance of cp in the current font
+int view_glyph(View *v, Font font, int cp, float *adv) {
+    if (cp >= 0 && cp < 128 && v->index[cp] >= 0) {
+        *adv = v->adv[cp];
+        return v->index[cp];
+    }
+    
+    int g = GetGlyphIndex(font, cp);
+    *adv = font.glyphs[g].advanceX ? font.glyphs[g].advanceX : font.recs[g].width;
+    *adv = *adv * v->size / font.baseSize + v->spacing;
+    
+    if (cp >= 0 && cp < 128) {
+        v->index[cp] = g;
+        v->adv[cp] = *adv;
+    }
+    return g;
+}
+
+// Throw the layouts away if the view changed shape. The font
+// is replaced together with the text size.
+void view_resize(View *v, Rectangle bounds, float size, float spacing) {
+    if (bounds.width == v->bounds.width && size == v->size && spacing == v->spacing) {
+        v->bounds = bounds;
+        return;
+    }
+    
+    v->bounds = bounds;
+    v->size = size;
+    v->spacing = spacing;
+    v->line_h = floorf(size * 1.25f);
+    v->gen++;
+    for (int i = 0; i < 128; i++) v->index[i] = -1;
+}
+
+void layout_line(Layout *l, u32 start) {
+    if (l->lines == l->starts_cap) {
+        l->starts_cap = l->starts_cap ? 2*l->starts_cap : 8;
+        l->starts = realloc(l->starts, l->starts_cap * sizeof(u32));
+    }
+    l->starts[l->lines++] = start;
+}
+
+// Shape message i, breaking lines between words when it can
+Layout *view_layout(View *v, History *h, size_t i) {
+    Layout *l = &v->cache[i % LAYOUT_CACHE];
+    if (l->gen == v->gen && l->msg == i) return l;
+    
+    const char *text = history_get(h, i);
+    size_t textlen = strlen(text);
+    Font font = GuiGetFont();
+    
+    // No more glyphs than bytes
+    if (textlen > l->glyphs_cap) {
+        l->glyphs_cap = textlen;
+        l->glyphs = realloc(l->glyphs, textlen * sizeof(u16));
+        l->xs = realloc(l->xs, textlen * sizeof(float));
+    }
+    
+    l->msg = i;
+    l->gen = v->gen;
+    l->lines = 0;
+    layout_line(l, 0);
+    
+    float x = 0, xword = 0;
+    u32 start = 0, word = 0, n = 0;
+    
+    for (size_t p = 0; p < textlen;) {
+        int size;
+        float w;
+        int cp = GetCodepointNext(text+p, &size);
+        int g = view_glyph(v, font, cp, &w);
+        
+        while (x + w > v->bounds.width && n > start) {
+            if (word > start) {
+                start = word;
+                x -= xword;
+                // The word moves to the start of the new line
+                for (u32 k = start; k < n; k++) l->xs[k] -= xword;
+            }
+            else {
+                start = n;
+                x = 0;
+            }
+            layout_line(l, start);
+            word = start;
+            xword = 0;
+        }
+        
+        l->glyphs[n] = cp == ' ' || cp == '\t' ? 0xFFFF : g;
+        l->xs[n] = x;
+        n++;
+        
+        x += w;
+        p += size;
+        if (cp == ' ') {
+            word = n;
+            xword = x;
+        }
+    }
+    
+    // One past the last line
+    layout_line(l, n);
+    l->lines--;
+    return l;
+}
+
+// Keep the bottom row on a message we still have
+void view_clamp(View *v, History *h) {
+    if (v->follow || v->msg >= h->end) {
+        v->msg = h->end-1;
+        v->line = view_layout(v, h, v->msg)->lines-1;
+    }
+    else if (v->msg < h->first) {
+        v->msg = h->first;
+        v->line = 0;
+    }
+    
+    Layout *l = view_layout(v, h, v->msg);
+    if (v->line >= l->lines) v->line = l->lines-1;
+}
+
+// One line further down, 0 if we're at the bottom already
+int view_down(View *v, History *h) {
+    if (v->line+1 < view_layout(v, h, v->msg)->lines) v->line++;
+    else if (v->msg+1 < h->end) {
+        v->msg++;
+        v->line = 0;
+    }
+    else return 0;
+    
+    if (v->msg+1 == h->end && v->line+1 == view_layout(v, h, v->msg)->lines)
+        v->follow = 1;
+    return 1;
+}
+
+// Don't leave rows empty at the top when scrolled to the start
+void view_fill(View *v, History *h) {
+    int rows = v->bounds.height / v->line_h;
+    long above = v->line;
+    size_t msg = v->msg;
+    
+    while (above < rows-1 && msg > h->first) {
+        msg--;
+        above += view_layout(v, h, msg)->lines;
+    }
+    
+    for (; above < rows-1 && !v->follow; above++) {
+        if (!view_down(v, h)) break;
+    }
+}
+
+// Move the bottom row by delta lines, up is negative
+void view_scroll(View *v, History *h, long delta) {
+    if (h->end == h->first) return;
+    
+    view_clamp(v, h);
+    
+    for (; delta < 0; delta++) {
+        if (v->line > 0) v->line--;
+        else if (v->msg > h->first) {
+            v->msg--;
+            v->line = view_layout(v, h, v->msg)->lines-1;
+        }
+        else break;
+        v->follow = 0;
+    }
+    
+    for (; delta > 0; delta--) {
+        if (!view_down(v, h)) break;
+    }
+    
+    view_fill(v, h);
+}
+
+// Draw one shaped line with its top left corner at pos
+void draw_line(Font font, Layout *l, u32 line, Vector2 pos, float size, Color color) {
+    float scale = size / font.baseSize, pad = font.glyphPadding;
+    
+    for (u32 k = l->starts[line]; k < l->starts[line+1]; k++) {
+        int g = l->glyphs[k];
+        if (g == 0xFFFF) continue;
+        
+        Rectangle r = font.recs[g];
+        Rectangle src = { r.x - pad, r.y - pad, r.width + 2*pad, r.height + 2*pad };
+        Rectangle dst = {
+            pos.x + l->xs[k] + (font.glyphs[g].offsetX - pad)*scale,
+            pos.y + (font.glyphs[g].offsetY - pad)*scale,
+            src.width*scale, src.height*scale
+        };
+        DrawTexturePro(font.texture, src, dst, (Vector2){0, 0}, 0, color);
+    }
+}
+
+// Redraw the texture if the view shows something else now.
+// Call it outside of BeginDrawing().
+void view_update(View *v, History *h) {
+    if (h->end == h->first) return;
+    
+    view_clamp(v, h);
+    view_fill(v, h);
+    
+    int w = v->bounds.width, ht = v->bounds.height;
+    
+    if (v->rt.texture.width != w || v->rt.texture.height != ht) {
+        if (v->rt.id) UnloadRenderTexture(v->rt);
+        v->rt = LoadRenderTexture(w, ht);
+    }
+    else if (v->drawn_first == h->first && v->drawn_end == h->end
+             && v->drawn_msg == v->msg && v->drawn_line == v->line
+             && v->drawn_gen == v->gen) return;
+    
+    v->drawn_first = h->first;
+    v->drawn_end = h->end;
+    v->drawn_msg = v->msg;
+    v->drawn_line = v->line;
+    v->drawn_gen = v->gen;
+    
+    Layout *l = view_layout(v, h, v->msg);
+    Font font = GuiGetFont();
+    Color color = GetColor(GuiGetStyle(LABEL, TEXT_COLOR_NORMAL));
+    int rows = v->bounds.height / v->line_h;
+    size_t msg = v->msg;
+    long line = v->line;
+    
+    BeginTextureMode(v->rt);
+    ClearBackground(GetColor(GuiGetStyle(DEFAULT, BACKGROUND_COLOR)));
+    
+    for (int row = rows-1; row >= 0; row--) {
+        if (line < 0) {
+            if (msg == h->first) break;
+            msg--;
+            l = view_layout(v, h, msg);
+            line = l->lines-1;
+        }
+        
+        Vector2 pos = { 0, row*v->line_h + floorf((v->line_h - v->size)/2) };
+        draw_line(font, l, line, pos, v->size, color);
+        line--;
+    }
+    
+    EndTextureMode();
+}
+
+void view_draw(View *v, History *h) {
+    if (h->end == h->first || v->rt.id == 0) return;
+    
+    // Render textures are upside down
+    Rectangle src = { 0, 0, v->rt.texture.width, -v->rt.texture.height };
+    DrawTextureRec(v->rt.texture, src, (Vector2){ floorf(v->bounds.x), floorf(v->bounds.y) }, WHITE);
+}
+
+// Mouse wheel over the view and the page keys
+void view_input(View *v, History *h) {
+    int rows = v->bounds.height / v->line_h;
+    float wheel = GetMouseWheelMove();
+    
+    if (wheel != 0 && CheckCollisionPointRec(GetMousePosition(), v->bounds)) {
+        // Touchpads report fractions of a notch
+        long delta = -3*wheel;
+        if (delta == 0) delta = wheel > 0 ? -1 : 1;
+        view_scroll(v, h, delta);
+    }
+    if (IsKeyPressed(KEY_PAGE_UP)) view_scroll(v, h, -(rows-1));
+    if (IsKeyPressed(KEY_PAGE_DOWN)) view_scroll(v, h, rows-1);
+}
+
+////////////////////////////////
+// Network thread
+// Blocks in recv() so the render loop never waits on the
+// socket. It ends when the server goes away or the UI shuts
+// the socket down.
+
+#ifdef _WIN32
+typedef HANDLE Thread;
+#else
+typedef pthread_t Thread;
+#endif
+
+Thread net_thread;
+int net_fd = -1;
+char *net_key;
+atomic_int net_done;
+
+void net_run(void) {
+    while (1) {
+        size_t sz;
+        byte *data;
+        
+        int got = 0;
+        while ((data = next_frame(&sz)) != NULL) {
+            if (is_control(data[0])) continue;
+            
+            byte *whole = NULL;
+            if (data[0] == T_PART) {
+                whole = data = part_add(data, sz, &sz);
+                if (data == NULL) continue;
+            }
+            
+            byte *text;
+            size_t len;
+            char *id = (char*)data+4;
+            
+            decode(data, sz, net_key, &text, &len);
+            // Has to fit the queue with room to spare
+            if (len > MQ_SIZE/4) {
+                mq_put("[%c%c] %.*s... (%zu bytes)", id[0], id[1],
+                       MQ_SIZE/4, text, len);
+            }
+            else mq_put("[%c%c] %.*s", id[0], id[1], (int)len, text);
+            free(whole);
+            got = 1;
+        }
+        if (got) mq_signal();
+        
+        if (receive(net_fd) <= 0) break;
+    }
+    
+    if (!atomic_load(&net_stopping)) mq_put("The server has disconnected");
+    atomic_store(&net_done, 1);
+    mq_signal();
+}
+
+#ifdef _WIN32
+DWORD WINAPI net_main(LPVOID arg) {
+    net_run();
+    return 0;
+}
+#else
+void *net_main(void *arg) {
+    net_run();
+    return NULL;
+}
+#endif
+
+void net_start(int fd, char *key) {
+    net_fd = fd;
+    net_key = key;
+    rbuf_head = rbuf_tail = 0;
+    atomic_store(&net_stopping, 0);
+    atomic_store(&net_done, 0);
+    
+    // Shared state the thread shouldn't race us on
+    aead_setup(key);
+    
+#ifdef _WIN32
+    if (mq_event == NULL) mq_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    net_thread = CreateThread(NULL, 0, net_main, NULL, 0, NULL);
+    if (net_thread == NULL) {
+        printf("CreateThread() failed\n");
+        exit(1);
+    }
+#else
+    if (pthread_create(&net_thread, NULL, net_main, NULL)) {
+        perror("pthread_create()");
+        exit(1);
+    }
+#endif
+}
+
+// Shut the connection down and wait for the thread
+void net_stop(void) {
+    atomic_store(&net_stopping, 1);
+    shutdown(net_fd, SHUT_RDWR);
+    
+#ifdef _WIN32
+    WaitForSingleObject(net_thread, INFINITE);
+    CloseHandle(net_thread);
+#else
+    pthread_join(net_thread, NULL);
+#endif
+    
+    closesocket(net_fd);
+    net_fd = -1;
+}
+
+// The window draws at full rate for this many frames after
+// anything happened, then waits for input or messages
+#define AWAKE_FRAMES 30
+#define IDLE_POLL_MS 30
+
+// Did the last PollInputEvents() see the user do anything
+int input_seen(void) {
+    Vector2 d = GetMouseDelta();
+    if (d.x != 0 || d.y != 0 || GetMouseWheelMove() != 0) return 1;
+    
+    for (int b = 0; b < 3; b++)
+        if (IsMouseButtonDown(b) || IsMouseButtonReleased(b)) return 1;
+    
+    // raygui repeats these while they're held
+    int held[] = { KEY_LEFT, KEY_RIGHT, KEY_UP, KEY_DOWN, KEY_BACKSPACE, KEY_DELETE };
+    for (int i = 0; i < 6; i++)
+        if (IsKeyDown(held[i])) return 1;
+    
+    // Nothing else in the GUI reads the key queue
+    int seen = 0;
+    while (GetKeyPressed()) seen = 1;
+    return seen;
+}
+
 char *trimleft(char *str) {
     for(;isspace(*str); str++);
     return str;
@@ -451,19 +1734,42 @@ int try_connect(u32 addr, u16 port) {
     return fd;
 }
 
-int main(void) {
+int main(int argc, char **argv) {
+    // Memory the history may take, in MiB
+    size_t history_mb = 64;
+    
+    for (int i = 1; i < argc; i++) {
+        if (cypher_option(argv[i])) continue;
+        
+        if (!strcmp(argv[i], "--history-mb") && i+1 < argc) {
+            history_mb = atol(argv[++i]);
+            if (history_mb == 0) history_mb = 1;
+            continue;
+        }
+        
+        printf("Options: --legacy to talk to old clients,\n"
+               "--aead for authenticated encryption,\n"
+               "--history-mb N to keep N MiB of history\n");
+        return 1;
+    }
+    
     SetConfigFlags(FLAG_WINDOW_RESIZABLE);
     InitWindow(480, 660, "guitext");
     SetTargetFPS(60);
     
-    Font font = LoadFontEx("CascadiaCode.ttf", 50, NULL, 0);
-    SetTextureFilter(font.texture, TEXTURE_FILTER_BILINEAR);
-    GuiSetFont(font);
-    GuiSetStyle(DEFAULT, TEXT_SIZE, 27);
+    // The font is rasterized at the size it is drawn at, again
+    // whenever resizing the window changes that size
+    Font font = {0};
+    int font_size = 0;
+    
+    History hist;
+    history_init(&hist, history_mb << 20);
+    
+    View view;
+    view_init(&view);
     
-    char **msgs = NULL;
     char *userid;
-    int running = 1, finish_query = 0, msgs_n = 0, connected = 0, connect_popup = 0, have_key = 0;
+    int running = 1, finish_query = 0, connected = 0, connect_popup = 0, have_key = 0;
     int fd = -1;
     byte nonce;
     char input[128], ipinput[128], key[128];
@@ -471,24 +1777,54 @@ int main(void) {
     memset(ipinput, 0, 128);
     memset(key, 0, 128);
     
-    // Message threshold
-    int msg_t = 16;
+    int awake = AWAKE_FRAMES;
     
     while (!CLOSE() && running) {
-        BeginDrawing();
-        ClearBackground(GetColor(GuiGetStyle(DEFAULT, BACKGROUND_COLOR)));
+        if (input_seen() || !mq_empty() || IsWindowResized()) awake = AWAKE_FRAMES;
         
-        GuiSetStyle(DEFAULT, TEXT_SIZE, floorf(0.04*GetScreenHeight()));
+        if (awake > 0) awake--;
+        else {
+            // Nothing to redraw: the last frame stays on screen
+            mq_wait(IDLE_POLL_MS);
+            PollInputEvents();
+            if (!input_seen() && mq_empty() && !IsWindowResized()
+                && !(connected && atomic_load(&net_done))) continue;
+            awake = AWAKE_FRAMES;
+        }
         
-        if (connected)
-            receive_all_and_print(fd, key, &msgs, &msgs_n);
+        int size = floorf(0.04*GetScreenHeight());
+        if (size != font_size) {
+            Font f = LoadFontEx("CascadiaCode.ttf", size, NULL, 0);
+            SetTextureFilter(f.texture, TEXTURE_FILTER_BILINEAR);
+            GuiSetFont(f);
+            if (font_size) UnloadFont(font);
+            font = f;
+            font_size = size;
+            GuiSetStyle(DEFAULT, TEXT_SIZE, size);
+        }
+        
+        // Whatever the network thread has decoded so far
+        char *m;
+        while ((m = mq_peek()) != NULL) {
+            history_add(&hist, m);
+            mq_pop();
+        }
         
-        int beg = 0;
-        if (msgs_n >= msg_t) beg = msgs_n-msg_t;
-        for (int i = beg; i < msgs_n; i++) {
-            GuiLabel(RELRECT(0.062, (0.055 + 0.05*(i-beg+1)), 0.94, 0.05), msgs[i]);
+        if (connected && atomic_load(&net_done)) {
+            net_stop();
+            connected = 0;
         }
         
+        view_resize(&view, RELRECT(0.062, 0.105, 0.88, 0.78),
+                    GuiGetStyle(DEFAULT, TEXT_SIZE), GuiGetStyle(DEFAULT, TEXT_SPACING));
+        view_input(&view, &hist);
+        view_update(&view, &hist);
+        
+        BeginDrawing();
+        ClearBackground(GetColor(GuiGetStyle(DEFAULT, BACKGROUND_COLOR)));
+        
+        view_draw(&view, &hist);
+        
         if (GuiButton(RELRECT(0.05, 0.036, 0.25, 0.045), "Exit")) {
             finish_query = 1;
         }
@@ -514,23 +1850,23 @@ int main(void) {
                 have_key = 1;
                 
                 userid = gen_userid();
-                char *msg = malloc(16+1);
+                char msg[16+1];
                 snprintf(msg, 16+1, "Your id is '%c%c'", userid[0], userid[1]);
-                msgs_n++;
-                msgs = realloc(msgs, sizeof(char*)*msgs_n);
-                msgs[msgs_n-1] = msg;
+                history_add(&hist, msg);
             }
         }
         
         ////////////////////////////////
         
         if (!connected) {
-            if (GuiButton(RELRECT(0.7, 0.036, 0.25, 0.045), "Connect")) {
+            // The key picks who we talk to, so it comes first
+            if (GuiButton(RELRECT(0.7, 0.036, 0.25, 0.045), "Connect") && have_key) {
                 connect_popup = 1;
             }
         }
         else {
             if (GuiButton(RELRECT(0.7, 0.036, 0.25, 0.045), "Disconnect")) {
+                net_stop();
                 connected = 0;
             }
         }
@@ -543,24 +1879,18 @@ int main(void) {
                 u32 addr;
                 u16 port;
                 if(parseip(ipinput, &addr, &port)) {
-                    char *msg = malloc(17+1);
-                    snprintf(msg, 17+1, "Invalid ip format");
-                    msgs_n++;
-                    msgs = realloc(msgs, sizeof(char*)*msgs_n);
-                    msgs[msgs_n-1] = msg;
+                    history_add(&hist, "Invalid ip format");
                     EndDrawing();
                     continue;
                 }
                 fd = try_connect(addr, port);
                 if (fd < 0) {
-                    char *msg = malloc(19+1);
-                    snprintf(msg, 19+1, "Connection refused");
-                    msgs_n++;
-                    msgs = realloc(msgs, sizeof(char*)*msgs_n);
-                    msgs[msgs_n-1] = msg;
+                    history_add(&hist, "Connection refused");
                     EndDrawing();
                     continue;
                 }
+                net_start(fd, key);
+                announce(fd, userid, key);
                 connected = 1;
             }
         }
@@ -571,21 +1901,19 @@ int main(void) {
             printf("Text box input: %s\n", input);
             char *i = trimleft(input);
             if (strlen(i)) {
-                char *msg = malloc(strlen(i)+1);
-                strcpy(msg, i);
-                msgs_n++;
-                msgs = realloc(msgs, sizeof(char*)*msgs_n);
-                msgs[msgs_n-1] = msg;
+                history_add(&hist, i);
                 
-                nonce++;
-                sendmessage(fd, userid, i, key, nonce);
+                if (!command(fd, userid, i)) {
+                    nonce++;
+                    sendmessage(fd, userid, i, key, nonce);
+                }
                 memset(input, 0, 128);
             }
         }
         
         EndDrawing();
     }
-    if (fd >= 0) shutdown(fd, SHUT_RDWR);
+    if (connected) net_stop();
     UnloadFont(font);
 }
 #endif
\ No newline at end of file
@@ -1,242 +1,2509 @@
+// accept4()
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
-#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <assert.h>
 #include <errno.h>
 #include <unistd.h>
 #include <signal.h>
 #include <time.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_URING
+#include <linux/io_uring.h>
+#endif
 
 ////////////////////////////////
 
+typedef uint64_t u64;
 typedef uint32_t u32;
 typedef uint16_t u16;
 typedef uint8_t  byte;
 
-typedef struct Conn Conn;
-struct Conn {
-    int fd;
-    int marked;
-    u32 addr;
-    u16 port;
-};
+// An immutable, refcounted frame. Every peer that still has
+// to write it holds one reference in the low half of refs,
+// every history ring keeping it one in the high half.
+typedef struct Frame Frame;
+struct Frame {
+    atomic_ullong refs;
+    // When it was received, in ns
+    u64 born;
+    // Only members of this room get it
+    u64 room;
+    // History frames in a replay batch, 0 for live frames
+    u64 replay;
+    size_t len;
+    byte data[];
+};
+
+// Ring of frame references, grows as needed
+typedef struct FrameQ FrameQ;
+struct FrameQ {
+    Frame **q;
+    size_t head, n, cap;
+};
+
+// A group a connection left, and the history frames of it
+// numbered below mark it already got
+typedef struct Seen Seen;
+struct Seen {
+    u64 room, mark;
+};
+
+typedef struct Conn Conn;
+struct Conn {
+    int fd;
+    int marked;
+    // Bumped every time the slot is freed, so stale handles
+    // to a reused slot can be told apart
+    u32 gen;
+    // Index in the active list, or the next free slot
+    u32 pos;
+    u32 addr;
+    u16 port;
+    // Partially received frames
+    byte *in;
+    size_t in_len, in_cap;
+    // Outbound ring of frames, flushed when the socket is
+    // writable. out_off is how much of the head frame is sent.
+    FrameQ out;
+    size_t out_off, out_bytes;
+    // History replays in out, they don't count against hwm
+    size_t replay_bytes;
+    // Parts of large messages. They go to out one at a time,
+    // when it is empty, so chat frames never wait behind more
+    // than one part.
+    FrameQ bulk;
+    size_t bulk_bytes;
+    int shedding;
+    // New connections don't send anything until the client
+    // has said which group it is in, or held_until passed,
+    // so the history can go out first
+    int held;
+    u64 held_until;
+    // Where the history stood when it was held
+    u64 hist_mark;
+    // Groups it was in before this one
+    Seen *seen;
+    u32 seen_n, seen_cap;
+    // Already on the dirty list
+    int dirty;
+    // io_uring only: requests the kernel still holds, and the
+    // gather list of the send in flight
+    int recving, sending, closing;
+    struct msghdr *msg;
+    // Hashes of the room name and of the key fingerprint
+    u64 room_name, keysum;
+    // Room table entry we are in, and our index in its
+    // member list
+    u64 room;
+    u32 room_pos;
+};
+
+// Control frames, handled here instead of relayed. The body
+// of T_JOIN is the room name, T_LEAVE (or an empty name)
+// goes back to the lobby. T_KEYSUM carries a fingerprint of
+// the client's key, frames only go to connections that sent
+// the same one (or none, like the sender).
+#define T_KEYSUM 0
+#define T_JOIN   5
+#define T_LEAVE  6
+// A part of a message too large for one frame, relayed as
+// usual but queued as bulk
+#define T_PART   7
+// The lobby, where every connection starts
+#define LOBBY 0
+
+// The local members of a room. Rooms live in an open
+// addressing table per worker and go away when empty.
+typedef struct Room Room;
+struct Room {
+    u64 key;
+    // NULL for a free table slot
+    Conn **members;
+    u32 n, cap;
+};
+
+// Header + the largest body the 2-byte length allows
+#define HDR_SZ 6
+#define MAX_FRAME (HDR_SZ+65535)
+#define IN_INIT 4096
+#define OUT_INIT 16
+// Frames gathered into one sendmsg()
+#define IOV_BATCH 64
+// Slots in each cross-shard ring, a power of 2
+#define RING_SZ 4096
+#define MAX_THREADS 256
+// Slots in a new room table, a power of 2
+#define ROOMS_INIT 64
+
+// epoll handles are (gen << 32) | slot, these slots are
+// never handed out
+#define H_LISTEN 0xFFFFFFFF
+#define H_WAKE   0xFFFFFFFE
+#define H_TIMER  0xFFFFFFFC
+#define NO_SLOT  0xFFFFFFFF
+
+// Single-producer single-consumer ring of frames, one per
+// pair of workers
+typedef struct Ring Ring;
+struct Ring {
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    Frame *slots[RING_SZ];
+};
+
+// Log2 histogram, bucket i counts values below 2^i
+#define HIST_N 40
+
+typedef struct Hist Hist;
+struct Hist {
+    atomic_ullong b[HIST_N];
+    atomic_ullong sum, count;
+};
+
+// Only the owning worker writes these, the admin thread
+// reads them
+typedef struct Stats Stats;
+struct Stats {
+    atomic_ullong accepted, closed;
+    atomic_ullong frames_in, frames_out;
+    // History frames replayed, kept out of frames_out
+    atomic_ullong replayed;
+    // Frames another worker's full inbox had no room for
+    atomic_ullong shard_dropped;
+    atomic_ullong bytes_in, bytes_out;
+    // Bytes sitting in outbound queues right now
+    atomic_ullong queued;
+    // Rooms with local members
+    atomic_ullong rooms;
+    // Busy time per loop iteration, ns
+    Hist loop;
+    // From receiving a frame to the last peer writing it, ns
+    Hist fanout;
+    // Frames in a peer's queue when another one is added
+    Hist depth;
+};
+
+typedef struct Uring Uring;
+
+// Every worker owns a listening socket (SO_REUSEPORT spreads
+// new connections between them), an epoll loop or an io_uring,
+// and its shard of connections. Frames for other shards go
+// through inbox.
+typedef struct Worker Worker;
+struct Worker {
+    int id;
+    pthread_t thread;
+    int server, ep;
+    // Set when the worker runs on io_uring instead of epoll
+    Uring *uring;
+    // eventfd, poked when frames arrive in the inbox
+    int wake;
+    atomic_int woken;
+    // timerfd, fires when the oldest held connection is due
+    int timer;
+    // Handles of held connections, oldest first
+    u64 *held;
+    size_t held_n, held_cap;
+    // inbox[i] is written by worker i only
+    Ring *inbox;
+    // Workers we have to wake at the end of this wakeup
+    byte *notify;
+    // Workers whose inbox from us was full the last time
+    byte *dropping;
+    // Fixed slab of connections. active lists the slots in
+    // use, free ones are chained through Conn.pos.
+    Conn *slots;
+    u32 *active;
+    u32 active_n, free_head;
+    // Connections marked during this wakeup
+    Conn **dead;
+    size_t dead_n, dead_cap;
+    // Connections that got new frames during this wakeup
+    Conn **dirty;
+    size_t dirty_n, dirty_cap;
+    // Room table, rooms_cap is a power of 2
+    Room *rooms;
+    u32 rooms_n, rooms_cap;
+    // Recent frames of every room, from all shards, oldest
+    // at hist_head
+    Frame **hist;
+    u32 hist_head, hist_n;
+    size_t hist_bytes;
+    // Frames ever added
+    u64 hist_total;
+    Stats stats;
+};
+
+FILE *logfile = NULL;
+
+// Recent frames kept per server and replayed to newcomers,
+// by count and by bytes
+u32 history_n = 100;
+size_t history_bytes = 1 << 20;
+// How long a new connection may take to say where it
+// belongs before it gets the lobby
+#define GRACE_NS 200000000ULL
+
+// Unsent bytes the kernel takes from us before a socket stops
+// being writable, about one part. Parts wait in our bulk
+// queue, where chat frames can pass them, not in the socket.
+#define NOTSENT_LOWAT 16384
+
+// Most bytes we queue for one peer before it counts as slow
+size_t hwm = 1 << 20;
+// Same for parts of large messages. The frames are shared
+// between peers, so a deep bulk queue is mostly pointers.
+size_t bulk_hwm = 32 << 20;
+// Drop frames for slow peers instead of disconnecting them
+int shed = 0;
+
+Worker *workers = NULL;
+int threads_n = 1;
+// Connection slots per worker
+u32 max_conns = 16384;
+int backlog = SOMAXCONN;
+// Where to serve metrics, a loopback port or a unix socket path
+char *admin_addr = NULL;
+// Run the workers on io_uring
+int use_uring = 0;
+
+////////////////////////////////
+// Logging
+// Workers format their lines into a lock-free ring and a
+// dedicated thread writes them out in batches, so relaying
+// never waits on stdio or the disk.
+
+enum { L_ERROR, L_INFO, L_DEBUG };
+
+// Slots in the log ring, a power of 2
+#define LOG_SZ 4096
+#define LOG_LINE 240
+
+typedef struct LogRec LogRec;
+struct LogRec {
+    // Slot i is free for position p when seq == p,
+    // and holds line p when seq == p+1
+    atomic_size_t seq;
+    int len;
+    char text[LOG_LINE];
+};
+
+LogRec logring[LOG_SZ];
+atomic_size_t log_tail;
+size_t log_head;
+atomic_ullong log_dropped;
+int log_level = L_INFO;
+
+// eventfd the writer sleeps on while the ring is empty
+int log_wake = -1;
+atomic_int log_asleep;
+atomic_int log_stop;
+pthread_t log_thread;
+
+void spawn(pthread_t *t, void *(*fn)(void*), void *arg);
+void uring_close(Worker *w, Conn *c);
+void uring_arm(Worker *w, Conn *c);
+void uring_send(Worker *w, Conn *c);
+void uring_free(Worker *w);
+void enqueue(Worker *w, Conn *c, Frame *f);
+void hold(Worker *w, Conn *c);
+void settle(Worker *w, Conn *c);
+
+#define logthis(f, ...) logmsg(L_INFO, f, ##__VA_ARGS__)
+#define logdebug(f, ...) logmsg(L_DEBUG, f, ##__VA_ARGS__)
+
+__attribute__((format(printf, 2, 3)))
+void logmsg(int level, const char *f, ...) {
+    if (level > log_level) return;
+    
+    ////////////////////////////////
+    // Claim a slot
+    
+    size_t pos = atomic_load_explicit(&log_tail, memory_order_relaxed);
+    LogRec *r;
+    
+    while (1) {
+        r = &logring[pos & (LOG_SZ-1)];
+        size_t seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&log_tail, &pos, pos+1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        }
+        // The writer is behind, don't wait for it
+        else if (dif < 0) {
+            atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+            return;
+        }
+        else {
+            pos = atomic_load_explicit(&log_tail, memory_order_relaxed);
+        }
+    }
+    
+    ////////////////////////////////
+    
+    va_list args;
+    va_start(args, f);
+    int len = vsnprintf(r->text, LOG_LINE, f, args);
+    va_end(args);
+    
+    r->len = len < 0 ? 0 : len >= LOG_LINE ? LOG_LINE-1 : len;
+    atomic_store_explicit(&r->seq, pos+1, memory_order_release);
+    
+    if (atomic_exchange(&log_asleep, 0)) {
+        u64 one = 1;
+        if (write(log_wake, &one, sizeof(one)) < 0) perror("write()");
+    }
+}
+
+// Append every ready line to buf, returns how many bytes
+size_t log_drain(char *buf, size_t cap) {
+    size_t len = 0;
+    
+    while (cap - len >= LOG_LINE) {
+        LogRec *r = &logring[log_head & (LOG_SZ-1)];
+        size_t seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+        if (seq != log_head+1) break;
+        
+        memcpy(buf+len, r->text, r->len);
+        len += r->len;
+        
+        atomic_store_explicit(&r->seq, log_head+LOG_SZ, memory_order_release);
+        log_head++;
+    }
+    
+    return len;
+}
+
+void *log_run(void *arg) {
+    static char buf[1 << 16];
+    u64 dropped = 0;
+    
+    while (1) {
+        size_t len = log_drain(buf, sizeof(buf));
+        
+        u64 d = atomic_load_explicit(&log_dropped, memory_order_relaxed);
+        if (d != dropped && sizeof(buf) - len >= LOG_LINE) {
+            len += snprintf(buf+len, LOG_LINE, "Dropped %llu log line(s)\n",
+                            (unsigned long long)(d - dropped));
+            dropped = d;
+        }
+        
+        if (len) {
+            fwrite(buf, 1, len, stdout);
+            fwrite(buf, 1, len, logfile);
+            // In case of crashes
+            fflush(stdout);
+            fflush(logfile);
+            continue;
+        }
+        
+        if (atomic_load(&log_stop)) break;
+        
+        // Go to sleep, but look at the ring once more in case
+        // a line came in before the flag was up
+        atomic_store(&log_asleep, 1);
+        LogRec *r = &logring[log_head & (LOG_SZ-1)];
+        if (atomic_load(&r->seq) == log_head+1 || atomic_load(&log_stop)) {
+            atomic_store(&log_asleep, 0);
+            continue;
+        }
+        
+        u64 cnt;
+        if (read(log_wake, &cnt, sizeof(cnt)) < 0 && errno != EINTR)
+            perror("read()");
+    }
+    
+    return NULL;
+}
+
+int log_start(void) {
+    for (size_t i = 0; i < LOG_SZ; i++) {
+        atomic_init(&logring[i].seq, i);
+    }
+    
+    if ((log_wake = eventfd(0, 0)) < 0) {
+        perror("eventfd()");
+        return -1;
+    }
+    
+    spawn(&log_thread, log_run, NULL);
+    return 0;
+}
+
+// Write out whatever is left and stop the writer
+void log_finish(void) {
+    atomic_store(&log_stop, 1);
+    u64 one = 1;
+    if (write(log_wake, &one, sizeof(one)) < 0) perror("write()");
+    pthread_join(log_thread, NULL);
+    close(log_wake);
+}
+
+////////////////////////////////
+// Metrics
+
+u64 now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+// There is a single writer, so a plain load and store will do
+void stat_add(atomic_ullong *c, u64 n) {
+    u64 v = atomic_load_explicit(c, memory_order_relaxed);
+    atomic_store_explicit(c, v+n, memory_order_relaxed);
+}
+
+void stat_sub(atomic_ullong *c, u64 n) {
+    u64 v = atomic_load_explicit(c, memory_order_relaxed);
+    atomic_store_explicit(c, v-n, memory_order_relaxed);
+}
+
+void hist_add(Hist *h, u64 v) {
+    int i = v ? 64 - __builtin_clzll(v) : 0;
+    if (i >= HIST_N) i = HIST_N-1;
+    stat_add(&h->b[i], 1);
+    stat_add(&h->sum, v);
+    stat_add(&h->count, 1);
+}
+
+////////////////////////////////
+// Helpers
+
+char *strip(uint32_t ip) {
+    static _Thread_local char buf[16] = {0};
+    snprintf(buf, 16, "%d.%d.%d.%d",
+             (ip & 0xFF000000)>>24,
+             (ip & 0xFF0000)>>16,
+             (ip & 0xFF00)>>8,
+             ip & 0xFF);
+    return buf;
+}
+
+// Convert from little-endian to host endianess
+u16 h16(byte *data) {
+    return data[0] | ((u16)data[1] << 8);
+}
+
+int setnonblock(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+////////////////////////////////
+// Connection table
+
+u64 conn_handle(Worker *w, Conn *c) {
+    return ((u64)c->gen << 32) | (u32)(c - w->slots);
+}
+
+// NULL if the slot has been freed since the handle was made
+Conn *conn_get(Worker *w, u64 h) {
+    u32 slot = h & 0xFFFFFFFF;
+    if (slot >= max_conns) return NULL;
+    Conn *c = &w->slots[slot];
+    if (c->gen != h >> 32 || c->fd < 0) return NULL;
+    return c;
+}
+
+Conn *conn_alloc(Worker *w) {
+    if (w->free_head == NO_SLOT) return NULL;
+    
+    u32 slot = w->free_head;
+    Conn *c = &w->slots[slot];
+    w->free_head = c->pos;
+    
+    u32 gen = c->gen;
+    *c = (Conn) { .gen = gen, .pos = w->active_n };
+    w->active[w->active_n++] = slot;
+    return c;
+}
+
+// Return the slot of c to the free list
+void conn_release(Worker *w, Conn *c) {
+    u32 slot = c - w->slots;
+    
+    // Swap the last active slot into our place
+    u32 last = w->active[--w->active_n];
+    w->active[c->pos] = last;
+    w->slots[last].pos = c->pos;
+    
+    c->fd = -1;
+    c->gen++;
+    c->pos = w->free_head;
+    w->free_head = slot;
+}
+
+void mark(Worker *w, Conn *c) {
+    if (c->marked) return;
+    c->marked = 1;
+    
+    if (w->dead_n == w->dead_cap) {
+        w->dead_cap = w->dead_cap ? w->dead_cap*2 : OUT_INIT;
+        w->dead = realloc(w->dead, sizeof(Conn*)*w->dead_cap);
+    }
+    w->dead[w->dead_n++] = c;
+}
+
+////////////////////////////////
+// Rooms
+
+// FNV-1a of a room name or key fingerprint, 0 is kept for
+// the lobby and for no fingerprint
+u64 room_key(byte *name, size_t len) {
+    if (len == 0) return LOBBY;
+    
+    u64 h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= name[i];
+        h *= 1099511628211ULL;
+    }
+    return h == LOBBY ? 1 : h;
+}
+
+// Rooms with the same name but different key fingerprints
+// get separate table entries
+u64 group_key(u64 room_name, u64 keysum) {
+    if (keysum == 0) return room_name;
+    
+    u64 h = room_name * 0x9E3779B97F4A7C15ULL + keysum;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return h == LOBBY ? 1 : h;
+}
+
+u32 room_slot(Worker *w, u64 key) {
+    return (key * 0x9E3779B97F4A7C15ULL) >> 32 & (w->rooms_cap-1);
+}
+
+Room *room_find(Worker *w, u64 key) {
+    if (w->rooms_cap == 0) return NULL;
+    
+    for (u32 i = room_slot(w, key);; i = (i+1) & (w->rooms_cap-1)) {
+        Room *r = &w->rooms[i];
+        if (r->members == NULL) return NULL;
+        if (r->key == key) return r;
+    }
+}
+
+void room_grow(Worker *w) {
+    Room *old = w->rooms;
+    u32 cap = w->rooms_cap;
+    
+    w->rooms_cap = cap ? cap*2 : ROOMS_INIT;
+    w->rooms = calloc(w->rooms_cap, sizeof(Room));
+    
+    for (u32 i = 0; i < cap; i++) {
+        if (old[i].members == NULL) continue;
+        u32 j = room_slot(w, old[i].key);
+        while (w->rooms[j].members) j = (j+1) & (w->rooms_cap-1);
+        w->rooms[j] = old[i];
+    }
+    free(old);
+}
+
+// Find the room, or add an empty one. The pointer is only
+// good until the next room is added or deleted.
+Room *room_get(Worker *w, u64 key) {
+    Room *r = room_find(w, key);
+    if (r) return r;
+    
+    // Keep the table at most half full
+    if ((w->rooms_n+1)*2 > w->rooms_cap) room_grow(w);
+    
+    u32 i = room_slot(w, key);
+    while (w->rooms[i].members) i = (i+1) & (w->rooms_cap-1);
+    
+    r = &w->rooms[i];
+    *r = (Room) {
+        .key = key,
+        .members = malloc(sizeof(Conn*)*OUT_INIT),
+        .cap = OUT_INIT
+    };
+    w->rooms_n++;
+    stat_add(&w->stats.rooms, 1);
+    return r;
+}
+
+// Remove an empty room. Entries further down the probe
+// sequence are shifted back, so lookups never need
+// tombstones.
+void room_delete(Worker *w, Room *r) {
+    u32 mask = w->rooms_cap-1;
+    u32 i = r - w->rooms, j = i;
+    
+    free(r->members);
+    
+    while (1) {
+        j = (j+1) & mask;
+        Room *next = &w->rooms[j];
+        if (next->members == NULL) break;
+        
+        // next can fill the hole if the hole lies between
+        // its home slot and j
+        u32 home = room_slot(w, next->key);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            w->rooms[i] = *next;
+            i = j;
+        }
+    }
+    
+    w->rooms[i] = (Room) {0};
+    w->rooms_n--;
+    stat_sub(&w->stats.rooms, 1);
+}
+
+void room_leave(Worker *w, Conn *c) {
+    Room *r = room_find(w, c->room);
+    assert(r != NULL);
+    
+    // Swap the last member into our place
+    Conn *last = r->members[--r->n];
+    r->members[c->room_pos] = last;
+    last->room_pos = c->room_pos;
+    
+    if (r->n == 0) room_delete(w, r);
+}
+
+// Put c in room key. Connections are always in exactly one
+// room, pass first to add one that isn't in any yet.
+void room_join(Worker *w, Conn *c, u64 key, int first) {
+    if (!first) {
+        if (c->room == key) return;
+        room_leave(w, c);
+    }
+    
+    Room *r = room_get(w, key);
+    if (r->n == r->cap) {
+        r->cap *= 2;
+        r->members = realloc(r->members, sizeof(Conn*)*r->cap);
+    }
+    
+    c->room = key;
+    c->room_pos = r->n;
+    r->members[r->n++] = c;
+}
+
+void room_free(Worker *w) {
+    for (u32 i = 0; i < w->rooms_cap; i++) {
+        free(w->rooms[i].members);
+    }
+    free(w->rooms);
+}
+
+////////////////////////////////
+
+// accept() a non-blocking socket, in one syscall where the
+// kernel has accept4()
+int accept_nonblock(int server, struct sockaddr_in *saddr, socklen_t *len) {
+#ifdef SOCK_NONBLOCK
+    static int have_accept4 = 1;
+    
+    if (have_accept4) {
+        int fd = accept4(server, (struct sockaddr*)saddr, len,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd >= 0 || errno != ENOSYS) return fd;
+        have_accept4 = 0;
+    }
+#endif
+    
+    int fd = accept(server, (struct sockaddr*)saddr, len);
+    if (fd < 0) return fd;
+    
+    if (setnonblock(fd) < 0) {
+        perror("fcntl()");
+        close(fd);
+        errno = ECONNABORTED;
+        return -1;
+    }
+    
+    return fd;
+}
+
+// Take a slot in the connection table for a new socket and
+// start receiving on it. Only connections that get one count
+// as accepted, so the open connection gauge stays right.
+void conn_open(Worker *w, int fd, u32 addr, u16 port) {
+    Conn *c = conn_alloc(w);
+    if (c == NULL) {
+        logthis("Connection table full, dropping %s:%d\n",
+                strip(addr), port);
+        close(fd);
+        return;
+    }
+    c->addr = addr;
+    c->port = port;
+    c->fd = fd;
+    
+    int lowat = NOTSENT_LOWAT;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) < 0)
+        perror("setsockopt()");
+    
+    if (w->uring) {
+        uring_arm(w, c);
+    }
+    else {
+        struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.u64 = conn_handle(w, c)
+        };
+        if (epoll_ctl(w->ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl()");
+            close(fd);
+            conn_release(w, c);
+            return;
+        }
+    }
+    
+    stat_add(&w->stats.accepted, 1);
+    room_join(w, c, LOBBY, 1);
+    hold(w, c);
+}
+
+// Accept every pending connection on the listening socket.
+// The listening socket is edge-triggered, so we have to
+// drain it until accept() would block.
+void accept_all(Worker *w) {
+    while (1) {
+        struct sockaddr_in saddr;
+        socklen_t len = sizeof(struct sockaddr_in);
+        
+        int fd = accept_nonblock(w->server, &saddr, &len);
+        
+        if (fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == ECONNABORTED || errno == EINTR) continue;
+            perror("accept()");
+            break;
+        }
+        
+        ////////////////////////////////
+        // Convert to host byte order
+        
+        u16 port = ntohs(saddr.sin_port);
+        u32 addr = ntohl(saddr.sin_addr.s_addr);
+        
+        logthis("Accepted %s:%d as fd=%d (worker %d)\n",
+                strip(addr), port, fd, w->id);
+        
+        conn_open(w, fd, addr, port);
+    }
+}
+
+////////////////////////////////
+
+// Size of the frame at the start of data, 0 if the header
+// hasn't been received yet
+size_t frame_size(byte *data, size_t len) {
+    if (len < HDR_SZ) return 0;
+    return HDR_SZ + h16(data+2);
+}
+
+// Make room for at least one more byte of the current frame
+void grow_in(Conn *c) {
+    size_t need = frame_size(c->in, c->in_len);
+    size_t cap = c->in_cap ? c->in_cap*2 : IN_INIT;
+    
+    if (cap < need) cap = need;
+    if (cap > MAX_FRAME) cap = MAX_FRAME;
+    
+    c->in = realloc(c->in, cap);
+    c->in_cap = cap;
+}
+
+Frame *frame_new(byte *data, size_t len) {
+    Frame *f = malloc(sizeof(Frame) + len);
+    atomic_init(&f->refs, 1);
+    f->born = now_ns();
+    f->room = LOBBY;
+    f->replay = 0;
+    f->len = len;
+    memcpy(f->data, data, len);
+    return f;
+}
+
+Frame *frame_ref(Frame *f) {
+    atomic_fetch_add_explicit(&f->refs, 1, memory_order_relaxed);
+    return f;
+}
+
+// Returns 1 if no peer has to write f any more
+int frame_unref(Frame *f) {
+    u64 left = atomic_fetch_sub_explicit(&f->refs, 1, memory_order_acq_rel) - 1;
+    if (left == 0) free(f);
+    return (u32)left == 0;
+}
+
+// Hold on to f for the history. Only called while holding a
+// peer reference, so frame_unref() can't see it as done early.
+void frame_keep(Frame *f) {
+    atomic_fetch_add_explicit(&f->refs, 1ULL << 32, memory_order_relaxed);
+}
+
+void frame_unkeep(Frame *f) {
+    if (atomic_fetch_sub_explicit(&f->refs, 1ULL << 32, memory_order_acq_rel) == 1ULL << 32)
+        free(f);
+}
+
+Frame *fq_at(FrameQ *q, size_t i) {
+    return q->q[(q->head + i) % q->cap];
+}
+
+void fq_grow(FrameQ *q) {
+    if (q->n == q->cap) {
+        size_t cap = q->cap ? q->cap*2 : OUT_INIT;
+        Frame **nq = malloc(sizeof(Frame*)*cap);
+        
+        // Unwrap into the new ring
+        for (size_t i = 0; i < q->n; i++) {
+            nq[i] = fq_at(q, i);
+        }
+        free(q->q);
+        
+        q->q = nq;
+        q->cap = cap;
+        q->head = 0;
+    }
+}
+
+// Takes over the caller's reference
+void fq_push(FrameQ *q, Frame *f) {
+    fq_grow(q);
+    q->q[(q->head + q->n) % q->cap] = f;
+    q->n++;
+}
+
+// Same, but f goes out first
+void fq_push_front(FrameQ *q, Frame *f) {
+    fq_grow(q);
+    q->head = (q->head + q->cap - 1) % q->cap;
+    q->q[q->head] = f;
+    q->n++;
+}
+
+// Hands the reference to the caller
+Frame *fq_pop(FrameQ *q) {
+    Frame *f = q->q[q->head];
+    q->head = (q->head + 1) % q->cap;
+    q->n--;
+    return f;
+}
+
+void fq_drop(FrameQ *q) {
+    for (size_t i = 0; i < q->n; i++) {
+        frame_unref(fq_at(q, i));
+    }
+    free(q->q);
+}
+
+////////////////////////////////
+// Cross-shard rings
+
+int ring_push(Ring *r, Frame *f) {
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    
+    if (tail - head == RING_SZ) return 0;
+    
+    r->slots[tail & (RING_SZ-1)] = f;
+    atomic_store_explicit(&r->tail, tail+1, memory_order_release);
+    return 1;
+}
+
+Frame *ring_pop(Ring *r) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    
+    if (head == tail) return NULL;
+    
+    Frame *f = r->slots[head & (RING_SZ-1)];
+    atomic_store_explicit(&r->head, head+1, memory_order_release);
+    return f;
+}
+
+// Wake w unless somebody already did and it hasn't run yet
+void wake_worker(Worker *w) {
+    if (atomic_exchange(&w->woken, 1)) return;
+    u64 one = 1;
+    if (write(w->wake, &one, sizeof(one)) < 0) perror("write()");
+}
+
+// The socket took res more bytes of the outbound ring,
+// release every frame that is fully out
+void out_advance(Worker *w, Conn *c, size_t res) {
+    c->out_bytes -= res;
+    stat_add(&w->stats.bytes_out, res);
+    stat_sub(&w->stats.queued, res);
+    res += c->out_off;
+    
+    while (c->out.n) {
+        Frame *f = fq_at(&c->out, 0);
+        if (res < f->len) break;
+        res -= f->len;
+        if (f->replay) {
+            c->replay_bytes -= f->len;
+            stat_add(&w->stats.replayed, f->replay);
+            frame_unref(f);
+        }
+        else {
+            stat_add(&w->stats.frames_out, 1);
+            u64 born = f->born;
+            if (frame_unref(f)) hist_add(&w->stats.fanout, now_ns() - born);
+        }
+        fq_pop(&c->out);
+    }
+    c->out_off = res;
+    
+    if (c->out.n == 0) c->shedding = 0;
+}
+
+// Once the outbound ring is empty, move the next bulk frame
+// into it. Returns 1 if there was one. With NOTSENT_LOWAT
+// the socket blocks after about one part, so the next is
+// only taken once the kernel has sent most of the last.
+int take_bulk(Conn *c) {
+    if (c->out.n || c->bulk.n == 0) return 0;
+    
+    Frame *f = fq_pop(&c->bulk);
+    c->bulk_bytes -= f->len;
+    fq_push(&c->out, f);
+    c->out_bytes += f->len;
+    return 1;
+}
+
+// Write as much of the outbound ring as the socket takes.
+// All pending frames go out in one gathered sendmsg().
+void flush_out(Worker *w, Conn *c) {
+    if (c->held) return;
+    
+    while (c->out.n || take_bulk(c)) {
+        struct iovec iov[IOV_BATCH];
+        size_t iovn = c->out.n < IOV_BATCH ? c->out.n : IOV_BATCH;
+        
+        for (size_t i = 0; i < iovn; i++) {
+            Frame *f = fq_at(&c->out, i);
+            iov[i].iov_base = f->data;
+            iov[i].iov_len = f->len;
+        }
+        iov[0].iov_base = (byte*)iov[0].iov_base + c->out_off;
+        iov[0].iov_len -= c->out_off;
+        
+        struct msghdr msg = {
+            .msg_iov = iov,
+            .msg_iovlen = iovn
+        };
+        
+        ssize_t res = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        
+        if (res < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EINTR) continue;
+            perror("sendmsg()");
+            mark(w, c);
+            return;
+        }
+        
+        out_advance(w, c, res);
+        
+        // Short write, the socket buffer is full
+        if (c->out_off) return;
+    }
+    
+    c->shedding = 0;
+}
+
+// Flush every connection on the dirty list
+void flush_dirty(Worker *w) {
+    for (size_t i = 0; i < w->dirty_n; i++) {
+        Conn *c = w->dirty[i];
+        c->dirty = 0;
+        if (c->marked || c->held) continue;
+        if (w->uring) uring_send(w, c);
+        else flush_out(w, c);
+    }
+    w->dirty_n = 0;
+}
+
+// Append a reference to f to the outbound ring, or to the
+// bulk ring for parts of large messages
+void push_out(Conn *c, Frame *f) {
+    if (f->data[0] == T_PART) {
+        fq_push(&c->bulk, frame_ref(f));
+        c->bulk_bytes += f->len;
+        return;
+    }
+    
+    fq_push(&c->out, frame_ref(f));
+    c->out_bytes += f->len;
+}
+
+void drop_out(Conn *c) {
+    fq_drop(&c->out);
+    fq_drop(&c->bulk);
+}
+
+// Bytes queued for c that count against hwm
+size_t out_live(Conn *c) {
+    size_t n = c->out_bytes - c->replay_bytes;
+    // out_bytes is already short of what went out of the head
+    if (c->out.n && fq_at(&c->out, 0)->replay) n += c->out_off;
+    return n;
+}
+
+// Queue one frame for c. Peers that fall more than hwm bytes
+// (bulk_hwm for parts) behind, history replays aside, are
+// either disconnected or skipped until they catch up.
+void dosend(Worker *w, Conn *c, Frame *f) {
+    int bulk = f->data[0] == T_PART;
+    int full = (bulk ? c->bulk_bytes : out_live(c)) + f->len > (bulk ? bulk_hwm : hwm);
+    
+    // Frames piled up while it was held, stop waiting for the
+    // client and start sending instead
+    if (full && c->held) {
+        settle(w, c);
+        enqueue(w, c, f);
+        return;
+    }
+    
+    if (full) {
+        if (!shed) {
+            logthis("Slow peer %s:%d, disconnecting\n",
+                    strip(c->addr), c->port);
+            mark(w, c);
+            return;
+        }
+        if (!c->shedding) {
+            logthis("Slow peer %s:%d, shedding frames\n",
+                    strip(c->addr), c->port);
+            c->shedding = 1;
+        }
+        return;
+    }
+    
+    enqueue(w, c, f);
+}
+
+// Flush c at the end of this wakeup, together with whatever
+// else gets queued until then
+void make_dirty(Worker *w, Conn *c) {
+    if (c->dirty) return;
+    
+    if (w->dirty_n == w->dirty_cap) {
+        w->dirty_cap = w->dirty_cap ? w->dirty_cap*2 : OUT_INIT;
+        w->dirty = realloc(w->dirty, sizeof(Conn*)*w->dirty_cap);
+    }
+    w->dirty[w->dirty_n++] = c;
+    c->dirty = 1;
+}
+
+// Queue f for c, whatever the high-water mark says
+void enqueue(Worker *w, Conn *c, Frame *f) {
+    int idle = c->out.n == 0;
+    hist_add(&w->stats.depth, c->out.n);
+    push_out(c, f);
+    stat_add(&w->stats.queued, f->len);
+    
+    // Nothing in flight, so the socket won't report EPOLLOUT
+    // (or there's no send to resubmit on io_uring)
+    if (idle) make_dirty(w, c);
+}
+
+// Resend data to the local members of its room but the user
+// who sent it (c is NULL for frames from other shards)
+void resend(Worker *w, Frame *f, Conn *c) {
+    assert(f != NULL);
+    
+    Room *r = room_find(w, f->room);
+    if (r == NULL) return;
+    
+    for (u32 i = 0; i < r->n; i++) {
+        Conn *p = r->members[i];
+        if (p == c || p->marked) continue;
+        dosend(w, p, f);
+    }
+}
+
+// Hand f over to every other shard
+void forward(Worker *w, Frame *f) {
+    for (int i = 0; i < threads_n; i++) {
+        if (i == w->id) continue;
+        
+        Worker *dst = &workers[i];
+        if (!ring_push(&dst->inbox[w->id], frame_ref(f))) {
+            // The other worker is far behind, its connections
+            // miss the frame whether they shed or not
+            frame_unref(f);
+            stat_add(&w->stats.shard_dropped, 1);
+            if (!w->dropping[i]) {
+                logthis("Worker %d is behind, dropping frames for it\n", i);
+                w->dropping[i] = 1;
+            }
+            continue;
+        }
+        w->dropping[i] = 0;
+        w->notify[i] = 1;
+    }
+}
+
+////////////////////////////////
+// History
+// Every worker sees every frame, its own and the ones other
+// shards forward, so each keeps the whole history and only
+// its own connections read it.
+
+void history_add(Worker *w, Frame *f) {
+    // Parts are too big to keep, and useless without the rest
+    if (history_n == 0 || f->len > history_bytes || f->data[0] == T_PART) return;
+    
+    while (w->hist_n == history_n || w->hist_bytes + f->len > history_bytes) {
+        Frame *old = w->hist[w->hist_head];
+        w->hist_head = (w->hist_head + 1) % history_n;
+        w->hist_n--;
+        w->hist_bytes -= old->len;
+        frame_unkeep(old);
+    }
+    
+    frame_keep(f);
+    w->hist[(w->hist_head + w->hist_n) % history_n] = f;
+    w->hist_n++;
+    w->hist_bytes += f->len;
+    w->hist_total++;
+}
+
+// The history frames of room numbered lo..hi-1, copied into
+// one frame so they go out in a single write. NULL if there
+// are none.
+Frame *history_batch(Worker *w, u64 room, u64 lo, u64 hi) {
+    // Oldest frame is number hist_total - hist_n
+    u64 first = w->hist_total - w->hist_n;
+    if (lo < first) lo = first;
+    
+    size_t len = 0;
+    u64 n = 0;
+    for (u64 i = lo; i < hi; i++) {
+        Frame *f = w->hist[(w->hist_head + (i - first)) % history_n];
+        if (f->room != room) continue;
+        len += f->len;
+        n++;
+    }
+    if (n == 0) return NULL;
+    
+    Frame *batch = malloc(sizeof(Frame) + len);
+    atomic_init(&batch->refs, 1);
+    batch->born = now_ns();
+    batch->room = room;
+    batch->replay = n;
+    batch->len = len;
+    
+    len = 0;
+    for (u64 i = lo; i < hi; i++) {
+        Frame *f = w->hist[(w->hist_head + (i - first)) % history_n];
+        if (f->room != room) continue;
+        memcpy(batch->data + len, f->data, f->len);
+        len += f->len;
+    }
+    return batch;
+}
+
+// Whether the history still has frames of s->room that c
+// got there, the ones catch_up() has to skip
+int seen_useful(Worker *w, Seen *s) {
+    u64 first = w->hist_total - w->hist_n;
+    for (u64 i = first; i < s->mark; i++) {
+        Frame *f = w->hist[(w->hist_head + (i - first)) % history_n];
+        if (f->room == s->room) return 1;
+    }
+    return 0;
+}
+
+// c is about to leave its group, it has everything that
+// group got so far
+void history_leave(Worker *w, Conn *c) {
+    if (history_n == 0) return;
+    
+    // Entries stop mattering once their frames fall out of
+    // the history, so there are never more than history_n
+    // that do
+    if (c->seen_n == c->seen_cap) {
+        u32 n = 0;
+        for (u32 i = 0; i < c->seen_n; i++) {
+            if (seen_useful(w, &c->seen[i])) c->seen[n++] = c->seen[i];
+        }
+        c->seen_n = n;
+    }
+    if (c->seen_n == c->seen_cap) {
+        c->seen_cap = c->seen_cap ? c->seen_cap*2 : 4;
+        c->seen = realloc(c->seen, sizeof(Seen)*c->seen_cap);
+    }
+    c->seen[c->seen_n++] = (Seen) { c->room, w->hist_total };
+}
+
+// c moved to another group, send the history of that group
+// it didn't get the last time it was there
+void catch_up(Worker *w, Conn *c) {
+    u64 mark = 0;
+    for (u32 i = 0; i < c->seen_n; i++) {
+        if (c->seen[i].room != c->room) continue;
+        mark = c->seen[i].mark;
+        c->seen[i] = c->seen[--c->seen_n];
+        break;
+    }
+    
+    Frame *batch = history_batch(w, c->room, mark, w->hist_total);
+    if (batch == NULL) return;
+    
+    c->replay_bytes += batch->len;
+    enqueue(w, c, batch);
+    frame_unref(batch);
+}
+
+// The client of a held connection has said where it belongs,
+// or took too long. Put the history in front of whatever was
+// queued meanwhile and start sending.
+void settle(Worker *w, Conn *c) {
+    u64 upto = c->hist_mark;
+    c->held = 0;
+    
+    // It left the lobby, what it got meanwhile isn't for it
+    if (c->room != LOBBY) {
+        stat_sub(&w->stats.queued, c->out_bytes + c->bulk_bytes);
+        drop_out(c);
+        c->out = c->bulk = (FrameQ) {0};
+        c->out_bytes = c->bulk_bytes = 0;
+        upto = w->hist_total;
+    }
+    
+    Frame *batch = history_batch(w, c->room, 0, upto);
+    
+    if (batch) {
+        fq_push_front(&c->out, batch);
+        c->out_bytes += batch->len;
+        c->replay_bytes += batch->len;
+        stat_add(&w->stats.queued, batch->len);
+    }
+    if (c->out.n || c->bulk.n) make_dirty(w, c);
+}
+
+void timer_arm(Worker *w, u64 at) {
+    struct itimerspec its = {
+        .it_value = { .tv_sec = at / 1000000000, .tv_nsec = at % 1000000000 }
+    };
+    if (timerfd_settime(w->timer, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        perror("timerfd_settime()");
+}
+
+// Hold a new connection until its client speaks up or the
+// grace period ends
+void hold(Worker *w, Conn *c) {
+    c->held = 1;
+    c->held_until = now_ns() + GRACE_NS;
+    c->hist_mark = w->hist_total;
+    
+    if (w->held_n == w->held_cap) {
+        w->held_cap = w->held_cap ? w->held_cap*2 : OUT_INIT;
+        w->held = realloc(w->held, sizeof(u64)*w->held_cap);
+    }
+    w->held[w->held_n++] = conn_handle(w, c);
+    
+    if (w->held_n == 1) timer_arm(w, c->held_until);
+}
+
+// Settle the held connections whose grace period is over
+void hold_expire(Worker *w) {
+    u64 now = now_ns();
+    size_t n = 0;
+    
+    for (size_t i = 0; i < w->held_n; i++) {
+        Conn *c = conn_get(w, w->held[i]);
+        if (c == NULL || !c->held || c->marked) continue;
+        if (now >= c->held_until) settle(w, c);
+        else w->held[n++] = w->held[i];
+    }
+    w->held_n = n;
+    
+    // They are held in order, the first one is due first
+    if (n) timer_arm(w, conn_get(w, w->held[0])->held_until);
+}
+
+void history_free(Worker *w) {
+    for (u32 i = 0; i < w->hist_n; i++) {
+        frame_unkeep(w->hist[(w->hist_head + i) % history_n]);
+    }
+    free(w->hist);
+}
+
+////////////////////////////////
+
+// Relay frames forwarded by other shards
+void drain_inbox(Worker *w) {
+    for (int i = 0; i < threads_n; i++) {
+        Frame *f;
+        while ((f = ring_pop(&w->inbox[i])) != NULL) {
+            resend(w, f, NULL);
+            history_add(w, f);
+            frame_unref(f);
+        }
+    }
+}
+
+// Wake the workers we forwarded frames to
+void notify_all(Worker *w) {
+    for (int i = 0; i < threads_n; i++) {
+        if (!w->notify[i]) continue;
+        w->notify[i] = 0;
+        wake_worker(&workers[i]);
+    }
+}
+
+////////////////////////////////
+
+// Relay every complete frame in the input buffer and keep
+// the partial tail for the next read
+void relay_frames(Worker *w, Conn *c) {
+    size_t off = 0, sz;
+    
+    while ((sz = frame_size(c->in+off, c->in_len-off)) &&
+           c->in_len-off >= sz) {
+        logdebug("Received data (fd=%d)\n", c->fd);
+        stat_add(&w->stats.frames_in, 1);
+        
+        byte type = c->in[off];
+        if (type == T_JOIN || type == T_LEAVE || type == T_KEYSUM) {
+            byte *body = c->in+off+HDR_SZ;
+            if (type == T_KEYSUM) c->keysum = room_key(body, sz-HDR_SZ);
+            else if (type == T_JOIN) c->room_name = room_key(body, sz-HDR_SZ);
+            else c->room_name = LOBBY;
+            
+            u64 key = group_key(c->room_name, c->keysum);
+            if (key != c->room) {
+                // Held ones got nothing of the lobby yet
+                if (!c->held) history_leave(w, c);
+                room_join(w, c, key, 0);
+                if (!c->held) catch_up(w, c);
+            }
+            if (c->held) settle(w, c);
+            off += sz;
+            continue;
+        }
+        
+        if (c->held) settle(w, c);
+        
+        // One copy out of the input buffer, shared by every peer
+        Frame *f = frame_new(c->in+off, sz);
+        f->room = c->room;
+        resend(w, f, c);
+        if (threads_n > 1) forward(w, f);
+        history_add(w, f);
+        frame_unref(f);
+        off += sz;
+    }
+    
+    if (off == 0) return;
+    memmove(c->in, c->in+off, c->in_len-off);
+    c->in_len -= off;
+}
+
+// Connections are non-blocking and edge-triggered, so keep
+// receiving until recv() would block. Whatever we get is
+// parsed right away; a half-sent frame stays in the buffer.
+void receive_and_resend(Worker *w, Conn *c) {
+    while (1) {
+        if (c->in_len == c->in_cap) grow_in(c);
+        
+        ssize_t res = recv(c->fd, c->in+c->in_len,
+                           c->in_cap-c->in_len, 0);
+        
+        if (res < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EINTR) continue;
+            perror("recv()");
+            mark(w, c);
+            return;
+        }
+        // The connection was closed
+        if (res == 0) {
+            mark(w, c);
+            return;
+        }
+        
+        c->in_len += res;
+        stat_add(&w->stats.bytes_in, res);
+        relay_frames(w, c);
+    }
+}
+
+////////////////////////////////
+
+void conn_free(Worker *w, Conn *c) {
+    // The kernel may still read our frames, wait for it
+    if (c->recving || c->sending) {
+        uring_close(w, c);
+        return;
+    }
+    
+    // Closing the fd also removes it from the epoll set
+    close(c->fd);
+    free(c->in);
+    free(c->msg);
+    free(c->seen);
+    stat_sub(&w->stats.queued, c->out_bytes + c->bulk_bytes);
+    drop_out(c);
+    room_leave(w, c);
+    conn_release(w, c);
+    stat_add(&w->stats.closed, 1);
+}
+
+void delete_marked(Worker *w) {
+    for (size_t i = 0; i < w->dead_n; i++) {
+        Conn *c = w->dead[i];
+        logthis("Deleting %s:%d\n",
+                strip(c->addr),
+                c->port);
+        conn_free(w, c);
+    }
+    
+    w->dead_n = 0;
+}
+
+////////////////////////////////
+
+// Read by every worker; lock-free, so fine in a handler
+atomic_int finish = 0;
+void intrhandle(int _sig) {
+    (void)_sig;
+    atomic_store_explicit(&finish, 1, memory_order_relaxed);
+}
+
+////////////////////////////////
+// io_uring backend
+// Same connection table, frames and outbound queues as the
+// epoll loop, only the I/O is handed to the kernel in batches:
+// a multishot accept, a multishot recv per connection into a
+// ring of provided buffers, and one gathered sendmsg per
+// connection with frames queued. Everything queued during a
+// wakeup is submitted, and the next completions reaped, with
+// a single io_uring_enter().
+
+#ifdef HAVE_URING
+
+#define URING_SQ 4096
+#define URING_CQ 16384
+// Provided receive buffers per worker, a power of 2
+#define UBUF_N 512
+#define UBUF_SZ 16384
+#define UBUF_GROUP 0
+
+// Send handles have this bit set in the slot, recv handles
+// are plain connection handles
+#define H_SEND   (1u << 30)
+#define H_CANCEL 0xFFFFFFFD
+
+struct Uring {
+    int fd;
+    // Submission queue, tail is ours until we publish it
+    unsigned *sq_head, *sq_tail, *sq_array;
+    unsigned sq_mask, sq_entries, tail;
+    struct io_uring_sqe *sqes;
+    // Completion queue
+    unsigned *cq_head, *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_sz, cq_map_sz, sqes_sz;
+    // Provided buffers
+    struct io_uring_buf_ring *br;
+    byte *bufs;
+    // The eventfd and the timerfd are read into these
+    u64 wake_cnt, timer_cnt;
+};
+
+int uring_enter(Uring *u, unsigned wait) {
+    __atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+    unsigned submit = u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    
+    return syscall(__NR_io_uring_enter, u->fd, submit, wait,
+                   wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+// A cleared submission entry, submitting the queue first if
+// it is full
+struct io_uring_sqe *uring_sqe(Uring *u) {
+    while (u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries) {
+        if (uring_enter(u, 0) < 0 && errno != EINTR && errno != EAGAIN
+            && errno != EBUSY) {
+            perror("io_uring_enter()");
+            break;
+        }
+    }
+    
+    unsigned i = u->tail & u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[i] = i;
+    u->tail++;
+    return sqe;
+}
+
+// Give receive buffer bid back to the kernel
+void uring_rebuf(Uring *u, unsigned bid) {
+    unsigned short tail = u->br->tail;
+    struct io_uring_buf *b = &u->br->bufs[tail & (UBUF_N-1)];
+    
+    b->addr = (u64)(uintptr_t)(u->bufs + (size_t)bid*UBUF_SZ);
+    b->len = UBUF_SZ;
+    b->bid = bid;
+    __atomic_store_n(&u->br->tail, tail+1, __ATOMIC_RELEASE);
+}
+
+void uring_accept(Worker *w) {
+    struct io_uring_sqe *sqe = uring_sqe(w->uring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = w->server;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = H_LISTEN;
+}
+
+void uring_wake(Worker *w) {
+    struct io_uring_sqe *sqe = uring_sqe(w->uring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = w->wake;
+    sqe->addr = (u64)(uintptr_t)&w->uring->wake_cnt;
+    sqe->len = sizeof(u64);
+    sqe->user_data = H_WAKE;
+}
+
+void uring_timer(Worker *w) {
+    struct io_uring_sqe *sqe = uring_sqe(w->uring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = w->timer;
+    sqe->addr = (u64)(uintptr_t)&w->uring->timer_cnt;
+    sqe->len = sizeof(u64);
+    sqe->user_data = H_TIMER;
+}
+
+// Start receiving on c
+void uring_arm(Worker *w, Conn *c) {
+    struct io_uring_sqe *sqe = uring_sqe(w->uring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = UBUF_GROUP;
+    sqe->user_data = conn_handle(w, c);
+    c->recving = 1;
+}
+
+// Send the outbound ring of c, unless a send is in flight
+// already; its completion sends the rest
+void uring_send(Worker *w, Conn *c) {
+    if (c->sending || c->marked || c->held) return;
+    take_bulk(c);
+    if (c->out.n == 0) return;
+    
+    if (c->msg == NULL) {
+        c->msg = malloc(sizeof(struct msghdr) + IOV_BATCH*sizeof(struct iovec));
+    }
+    struct iovec *iov = (struct iovec*)(c->msg+1);
+    size_t iovn = c->out.n < IOV_BATCH ? c->out.n : IOV_BATCH;
+    
+    for (size_t i = 0; i < iovn; i++) {
+        Frame *f = fq_at(&c->out, i);
+        iov[i].iov_base = f->data;
+        iov[i].iov_len = f->len;
+    }
+    iov[0].iov_base = (byte*)iov[0].iov_base + c->out_off;
+    iov[0].iov_len -= c->out_off;
+    
+    *c->msg = (struct msghdr) {
+        .msg_iov = iov,
+        .msg_iovlen = iovn
+    };
+    
+    struct io_uring_sqe *sqe = uring_sqe(w->uring);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->fd;
+    sqe->addr = (u64)(uintptr_t)c->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = conn_handle(w, c) | H_SEND;
+    c->sending = 1;
+}
+
+// c is going away while the kernel still holds requests on it.
+// Shutting the socket down completes them, the last one
+// frees c.
+void uring_close(Worker *w, Conn *c) {
+    if (c->closing) return;
+    c->closing = 1;
+    shutdown(c->fd, SHUT_RDWR);
+    
+    if (c->recving) {
+        struct io_uring_sqe *sqe = uring_sqe(w->uring);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = conn_handle(w, c);
+        sqe->user_data = H_CANCEL;
+    }
+}
+
+void uring_accepted(Worker *w, int fd) {
+    struct sockaddr_in saddr;
+    socklen_t len = sizeof(saddr);
+    
+    if (getpeername(fd, (struct sockaddr*)&saddr, &len) < 0) {
+        close(fd);
+        return;
+    }
+    
+    u16 port = ntohs(saddr.sin_port);
+    u32 addr = ntohl(saddr.sin_addr.s_addr);
+    
+    logthis("Accepted %s:%d as fd=%d (worker %d)\n",
+            strip(addr), port, fd, w->id);
+    conn_open(w, fd, addr, port);
+}
+
+void uring_received(Worker *w, Conn *c, struct io_uring_cqe *cqe) {
+    Uring *u = w->uring;
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    
+    if (!more) c->recving = 0;
+    
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        byte *buf = u->bufs + (size_t)bid*UBUF_SZ;
+        size_t off = 0;
+        
+        if (cqe->res > 0 && !c->marked) stat_add(&w->stats.bytes_in, cqe->res);
+        
+        // Same as a recv() into the input buffer
+        while (cqe->res > 0 && off < (size_t)cqe->res && !c->marked) {
+            if (c->in_len == c->in_cap) grow_in(c);
+            size_t n = cqe->res - off;
+            if (n > c->in_cap - c->in_len) n = c->in_cap - c->in_len;
+            memcpy(c->in + c->in_len, buf + off, n);
+            c->in_len += n;
+            off += n;
+            relay_frames(w, c);
+        }
+        uring_rebuf(u, bid);
+    }
+    
+    if (c->marked) {
+        if (!c->recving && !c->sending && c->closing) conn_free(w, c);
+        return;
+    }
+    
+    // The connection was closed
+    if (cqe->res == 0) {
+        mark(w, c);
+        return;
+    }
+    if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+        errno = -cqe->res;
+        perror("recv()");
+        mark(w, c);
+        return;
+    }
+    
+    // Multishot stops when we run out of buffers, or whenever
+    // the kernel feels like it
+    if (!more) uring_arm(w, c);
+}
+
+void uring_sent(Worker *w, Conn *c, struct io_uring_cqe *cqe) {
+    c->sending = 0;
+    
+    if (cqe->res > 0) out_advance(w, c, cqe->res);
+    
+    if (c->marked) {
+        if (!c->recving && c->closing) conn_free(w, c);
+        return;
+    }
+    
+    if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -EINTR) {
+        errno = -cqe->res;
+        perror("sendmsg()");
+        mark(w, c);
+        return;
+    }
+    
+    // Short write, or more frames queued meanwhile
+    uring_send(w, c);
+}
+
+int uring_init(Worker *w) {
+    Uring *u = calloc(1, sizeof(Uring));
+    struct io_uring_params p = {
+        .flags = IORING_SETUP_CQSIZE,
+        .cq_entries = URING_CQ
+    };
+    
+    u->fd = syscall(__NR_io_uring_setup, URING_SQ, &p);
+    if (u->fd < 0) {
+        perror("io_uring_setup()");
+        free(u);
+        return -1;
+    }
+    
+    ////////////////////////////////
+    // Map the rings
+    
+    u->sq_map_sz = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    u->cq_map_sz = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    u->sqes_sz = p.sq_entries*sizeof(struct io_uring_sqe);
+    
+    u->sq_map = mmap(NULL, u->sq_map_sz, PROT_READ|PROT_WRITE,
+                     MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->cq_map = mmap(NULL, u->cq_map_sz, PROT_READ|PROT_WRITE,
+                     MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    u->sqes = mmap(NULL, u->sqes_sz, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sq_map == MAP_FAILED || u->cq_map == MAP_FAILED || u->sqes == MAP_FAILED) {
+        perror("mmap()");
+        close(u->fd);
+        free(u);
+        return -1;
+    }
+    
+    byte *sq = u->sq_map, *cq = u->cq_map;
+    u->sq_head = (unsigned*)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    u->sq_array = (unsigned*)(sq + p.sq_off.array);
+    u->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->tail = *u->sq_tail;
+    u->cq_head = (unsigned*)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    u->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    
+    ////////////////////////////////
+    // Register the receive buffers
+    
+    u->br = mmap(NULL, UBUF_N*sizeof(struct io_uring_buf), PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    u->bufs = malloc((size_t)UBUF_N*UBUF_SZ);
+    
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (u64)(uintptr_t)u->br,
+        .ring_entries = UBUF_N,
+        .bgid = UBUF_GROUP
+    };
+    if (u->br == MAP_FAILED ||
+        syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("io_uring_register()");
+        w->uring = u;
+        uring_free(w);
+        return -1;
+    }
+    
+    for (unsigned i = 0; i < UBUF_N; i++) uring_rebuf(u, i);
+    
+    w->uring = u;
+    uring_accept(w);
+    uring_wake(w);
+    uring_timer(w);
+    return 0;
+}
 
-FILE *logfile = NULL;
+void uring_free(Worker *w) {
+    Uring *u = w->uring;
+    if (u == NULL) return;
+    
+    // Closing the ring cancels whatever is still in flight
+    close(u->fd);
+    munmap(u->sq_map, u->sq_map_sz);
+    munmap(u->cq_map, u->cq_map_sz);
+    munmap(u->sqes, u->sqes_sz);
+    if (u->br != MAP_FAILED) munmap(u->br, UBUF_N*sizeof(struct io_uring_buf));
+    free(u->bufs);
+    free(u);
+    w->uring = NULL;
+    
+    for (u32 i = 0; i < w->active_n; i++) {
+        Conn *c = &w->slots[w->active[i]];
+        c->recving = c->sending = 0;
+    }
+}
 
-////////////////////////////////
-// Helpers
+void uring_run(Worker *w) {
+    Uring *u = w->uring;
+    
+    while (!atomic_load_explicit(&finish, memory_order_relaxed)) {
+        if (uring_enter(u, 1) < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            perror("io_uring_enter()");
+            break;
+        }
+        
+        u64 start = now_ns();
+        unsigned head = *u->cq_head;
+        unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+            u64 h = cqe->user_data;
+            
+            if (h == H_LISTEN) {
+                if (cqe->res >= 0) uring_accepted(w, cqe->res);
+                else if (cqe->res != -ECONNABORTED && cqe->res != -EINTR) {
+                    errno = -cqe->res;
+                    perror("accept()");
+                }
+                if (!(cqe->flags & IORING_CQE_F_MORE)) uring_accept(w);
+                continue;
+            }
+            
+            if (h == H_WAKE) {
+                // Reset before draining, so a frame pushed after
+                // the drain wakes us again
+                atomic_store(&w->woken, 0);
+                drain_inbox(w);
+                uring_wake(w);
+                continue;
+            }
+            
+            if (h == H_TIMER) {
+                hold_expire(w);
+                uring_timer(w);
+                continue;
+            }
+            
+            if (h == H_CANCEL) continue;
+            
+            Conn *c = conn_get(w, h & ~(u64)H_SEND);
+            if (c == NULL) continue;
+            
+            if (h & H_SEND) uring_sent(w, c, cqe);
+            else uring_received(w, c, cqe);
+        }
+        
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+        
+        flush_dirty(w);
+        notify_all(w);
+        delete_marked(w);
+        
+        hist_add(&w->stats.loop, now_ns() - start);
+    }
+}
 
-#define logthis(f, ...)\
-(printf(f, ##__VA_ARGS__),\
-fprintf(logfile, f, ##__VA_ARGS__))
+#else
 
-char *strip(uint32_t ip) {
-    static char buf[16] = {0};
-    snprintf(buf, 16, "%d.%d.%d.%d",
-             (ip & 0xFF000000)>>24,
-             (ip & 0xFF0000)>>16,
-             (ip & 0xFF00)>>8,
-             ip & 0xFF);
-    return buf;
+int uring_init(Worker *w) {
+    printf("Built without io_uring support\n");
+    return -1;
 }
 
-// Convert from little-endian to host endianess
-u16 h16(byte *data) {
-    return data[0] | ((u16)data[1] << 8);
-}
+void uring_free(Worker *w) {}
+void uring_run(Worker *w) {}
+void uring_arm(Worker *w, Conn *c) {}
+void uring_send(Worker *w, Conn *c) {}
+void uring_close(Worker *w, Conn *c) {}
+
+#endif
 
 ////////////////////////////////
 
-void accept_all(int server, Conn **conns, size_t *n) {
-    struct sockaddr_in saddr;
-    socklen_t len = sizeof(struct sockaddr_in);
+// A non-blocking listening socket. SO_REUSEPORT lets every
+// worker bind its own to the same port.
+int open_listener(int lport) {
+    int server = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     
-    int fd = accept(server, (struct sockaddr*)&saddr, &len);
+    if (server < 0) {
+        perror("socket()");
+        return -1;
+    }
     
-    if (fd < 0) {
-        if (errno == EWOULDBLOCK) return;
-        if (errno = ECONNABORTED) return;
-        perror("accept()");
-        return;
+    ////////////////////////////////
+    // Allow reuse
+    
+    int reuse = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (setsockopt(server, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+        perror("setsockopt()");
+        close(server);
+        return -1;
     }
     
     ////////////////////////////////
-    // Convert to host byte order
     
-    u16 port = ntohs(saddr.sin_port);
-    u32 addr = ntohl(saddr.sin_addr.s_addr);
+    struct sockaddr_in serveraddr;
+    memset(&serveraddr, 0, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_port = htons(lport);
+    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
     
-    logthis("Accepted %s:%d as fd=%d\n", strip(addr), port, fd);
     
+    if(bind(server, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) < 0) {
+        perror("bind()");
+        close(server);
+        return -1;
+    }
     
     ////////////////////////////////
-    // Append to the array of connections
-    
-    (*n)++;
-    *conns = realloc(*conns, sizeof(Conn)*(*n));
-    (*conns)[*n-1] = (Conn) {
-        .addr = addr,
-        .port = port,
-        .fd = fd
-    };
+    // Set non-blocking
+    
+    if (setnonblock(server) < 0) {
+        perror("fcntl()");
+        close(server);
+        return -1;
+    }
+    
+    ////////////////////////////////
+    
+    if (listen(server, backlog) < 0) {
+        perror("listen()");
+        close(server);
+        return -1;
+    }
+    
+    return server;
 }
 
-////////////////////////////////
-
-// Receive one message from fd
-byte *receive(int fd, size_t *sz, int *close) {
-    assert(fd >= 0);
+// Set up the listening socket, epoll set and inbox of w
+int worker_init(Worker *w, int id, int lport) {
+    *w = (Worker) {
+        .id = id,
+        .server = -1,
+        .ep = -1,
+        .wake = -1,
+        .timer = -1
+    };
+    
+    w->inbox = calloc(threads_n, sizeof(Ring));
+    w->notify = calloc(threads_n, 1);
+    w->dropping = calloc(threads_n, 1);
     
-    byte buf[128];
-    byte *data = NULL;
-    ssize_t res = 0;
+    w->slots = calloc(max_conns, sizeof(Conn));
+    w->active = calloc(max_conns, sizeof(u32));
+    for (u32 i = 0; i < max_conns; i++) {
+        w->slots[i].fd = -1;
+        w->slots[i].pos = i+1 < max_conns ? i+1 : NO_SLOT;
+    }
+    w->free_head = 0;
     
-    *sz = 0;
+    // Never grows, frames go when it's full
+    w->hist = calloc(history_n ? history_n : 1, sizeof(Frame*));
     
-    while (1) {
-        if ((res = recv(fd, buf, 128, 0)) < 0) {
-            perror("recv()");
-            if (data != NULL) free(data);
-            return NULL;
-        }
-        if (!res) {
-            *close = 1;
-            return NULL;
-        }
-        *sz += res;
-        // Append the data
-        data = realloc(data, *sz);
-        memcpy(data+*sz-res, buf, res);
-        // Haven't received the header yet
-        if (*sz < 6) continue;
-        // Haven't received the full message length
-        if (*sz < (size_t)(h16(data+2)+(u16)6)) continue;
-        break;
+    if ((w->server = open_listener(lport)) < 0) return -1;
+    
+    if ((w->wake = eventfd(0, EFD_NONBLOCK)) < 0) {
+        perror("eventfd()");
+        return -1;
+    }
+    
+    if ((w->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0) {
+        perror("timerfd_create()");
+        return -1;
     }
     
-    logthis("Received data (fd=%d)\n", fd);
+    if (use_uring) {
+        if (uring_init(w) == 0) return 0;
+        if (id == 0) logthis("io_uring unavailable, using epoll\n");
+    }
     
-    return data;
-}
-
-void dosend(Conn *c, byte *data, size_t len) {
-    if (send(c->fd, data, len, MSG_NOSIGNAL) < 0) {
-        perror("send()");
-        c->marked = 1;
+    if ((w->ep = epoll_create1(0)) < 0) {
+        perror("epoll_create1()");
+        return -1;
+    }
+    
+    // The listening socket, the eventfd and the timerfd get
+    // reserved handles
+    struct epoll_event lev = {
+        .events = EPOLLIN | EPOLLET,
+        .data.u64 = H_LISTEN
+    };
+    if (epoll_ctl(w->ep, EPOLL_CTL_ADD, w->server, &lev) < 0) {
+        perror("epoll_ctl()");
+        return -1;
+    }
+    
+    struct epoll_event wev = {
+        .events = EPOLLIN | EPOLLET,
+        .data.u64 = H_WAKE
+    };
+    if (epoll_ctl(w->ep, EPOLL_CTL_ADD, w->wake, &wev) < 0) {
+        perror("epoll_ctl()");
+        return -1;
+    }
+    
+    struct epoll_event tev = {
+        .events = EPOLLIN,
+        .data.u64 = H_TIMER
+    };
+    if (epoll_ctl(w->ep, EPOLL_CTL_ADD, w->timer, &tev) < 0) {
+        perror("epoll_ctl()");
+        return -1;
     }
+    
+    return 0;
 }
 
-// Resend data to all but the user who sent it
-void resend(byte *data, size_t sz,
-            Conn c, Conn **conns, size_t *n) {
-    assert(data != NULL);
-    
-    for (size_t i = 0; i < *n; i++) {
-        if ((*conns)[i].fd == c.fd) continue;
-        dosend(&((*conns)[i]), data, sz);
+void worker_free(Worker *w) {
+    uring_free(w);
+    while (w->active && w->active_n) {
+        conn_free(w, &w->slots[w->active[0]]);
+    }
+    // Frames nobody picked up
+    for (int i = 0; i < threads_n && w->inbox; i++) {
+        Frame *f;
+        while ((f = ring_pop(&w->inbox[i])) != NULL) frame_unref(f);
     }
+    if (w->ep >= 0) close(w->ep);
+    if (w->wake >= 0) close(w->wake);
+    if (w->timer >= 0) close(w->timer);
+    if (w->server >= 0) close(w->server);
+    free(w->slots);
+    free(w->active);
+    free(w->dead);
+    free(w->dirty);
+    room_free(w);
+    history_free(w);
+    free(w->held);
+    free(w->inbox);
+    free(w->notify);
+    free(w->dropping);
 }
 
-void receive_and_resend(Conn **conns, size_t *n) {
-    ////////////////////////////////
-    // Poll
-    
-    struct pollfd fds[*n];
+void *worker_run(void *arg) {
+    Worker *w = arg;
+    struct epoll_event events[64];
     
-    for (size_t i = 0; i < *n; i++) {
-        fds[i].fd = (*conns)[i].fd;
-        fds[i].events = POLLIN | POLLHUP;
+    if (w->uring) {
+        uring_run(w);
+        return NULL;
     }
     
-    int ret = poll(fds, *n, 300);
-    
-    if (ret <= 0) return;
-    ////////////////////////////////
-    // Receive
-    
-    for (size_t i = 0; i < *n; i++) {
-        // Mark for deletion
-        if (fds[i].revents & (POLLHUP|POLLERR|POLLNVAL)) {
-            (*conns)[i].marked = 1;
-        }
-        // Receive
-        else if (fds[i].revents & POLLIN) {
-            size_t sz;
-            int close = 0;
-            byte *data = receive(fds[i].fd, &sz, &close);
-            if (close) {
-                (*conns)[i].marked = 1;
+    while (!atomic_load_explicit(&finish, memory_order_relaxed)) {
+        int ret = epoll_wait(w->ep, events, 64, -1);
+        
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait()");
+            break;
+        }
+        
+        u64 start = now_ns();
+        
+        for (int i = 0; i < ret; i++) {
+            u64 h = events[i].data.u64;
+            
+            if (h == H_LISTEN) {
+                accept_all(w);
                 continue;
             }
-            if (data != NULL) {
-                resend(data, sz, (*conns)[i], conns, n);
-                free(data);
+            
+            if (h == H_WAKE) {
+                u64 cnt;
+                if (read(w->wake, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+                    perror("read()");
+                // Reset before draining, so a frame pushed after
+                // the drain wakes us again
+                atomic_store(&w->woken, 0);
+                drain_inbox(w);
+                continue;
+            }
+            
+            if (h == H_TIMER) {
+                u64 cnt;
+                if (read(w->timer, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+                    perror("read()");
+                hold_expire(w);
+                continue;
+            }
+            
+            Conn *c = conn_get(w, h);
+            if (c == NULL || c->marked) continue;
+            
+            if (events[i].events & EPOLLOUT) {
+                flush_out(w, c);
+            }
+            if (events[i].events & EPOLLIN) {
+                receive_and_resend(w, c);
+            }
+            // Mark for deletion
+            if (events[i].events & (EPOLLHUP|EPOLLERR|EPOLLRDHUP)) {
+                mark(w, c);
             }
         }
+        
+        flush_dirty(w);
+        notify_all(w);
+        delete_marked(w);
+        
+        hist_add(&w->stats.loop, now_ns() - start);
     }
+    
+    return NULL;
 }
 
 ////////////////////////////////
+// Admin socket
+// Serves the worker stats in the Prometheus text format to
+// anything that connects, one scrape per connection.
 
-void delete_marked(Conn **conns, size_t *n) {
-    size_t n2 = 0;
-    
-    for (size_t i = 0; i < *n; i++) {
-        if (!(*conns)[i].marked) n2++;
+pthread_t admin_thread;
+int admin_fd = -1;
+
+u64 sum_stat(size_t off) {
+    u64 v = 0;
+    for (int i = 0; i < threads_n; i++) {
+        atomic_ullong *c = (atomic_ullong*)((byte*)&workers[i].stats + off);
+        v += atomic_load_explicit(c, memory_order_relaxed);
     }
+    return v;
+}
+
+#define STAT(field) sum_stat(offsetof(Stats, field))
+
+void put_counter(FILE *out, const char *name, const char *type,
+                 const char *help, u64 v) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n",
+            name, help, name, type, name, (unsigned long long)v);
+}
+
+// scale converts the bucket bounds, e.g. from ns to seconds
+void put_hist(FILE *out, const char *name, const char *help,
+              size_t off, double scale) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
     
-    // No connection is marked
-    if (*n == n2) return;
+    u64 acc = 0;
+    for (int i = 0; i < HIST_N; i++) {
+        acc += sum_stat(off + offsetof(Hist, b) + i*sizeof(atomic_ullong));
+        if (i == HIST_N-1) break;
+        fprintf(out, "%s_bucket{le=\"%g\"} %llu\n",
+                name, (double)(1ULL << i) * scale, (unsigned long long)acc);
+    }
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)acc);
+    fprintf(out, "%s_sum %g\n", name,
+            (double)sum_stat(off + offsetof(Hist, sum)) * scale);
+    fprintf(out, "%s_count %llu\n", name,
+            (unsigned long long)sum_stat(off + offsetof(Hist, count)));
+}
+
+void put_metrics(FILE *out) {
+    u64 accepted = STAT(accepted), closed = STAT(closed);
     
-    Conn *conns2 = malloc(sizeof(Conn)*n2);
+    put_counter(out, "chat_connections_accepted_total", "counter",
+                "Connections accepted", accepted);
+    put_counter(out, "chat_connections_closed_total", "counter",
+                "Connections closed", closed);
+    put_counter(out, "chat_connections", "gauge",
+                "Connections open", accepted - closed);
+    put_counter(out, "chat_frames_in_total", "counter",
+                "Frames received", STAT(frames_in));
+    put_counter(out, "chat_frames_out_total", "counter",
+                "Frames written to peers", STAT(frames_out));
+    put_counter(out, "chat_replayed_frames_total", "counter",
+                "History frames replayed to peers", STAT(replayed));
+    put_counter(out, "chat_bytes_in_total", "counter",
+                "Bytes received", STAT(bytes_in));
+    put_counter(out, "chat_bytes_out_total", "counter",
+                "Bytes written to peers", STAT(bytes_out));
+    put_counter(out, "chat_queued_bytes", "gauge",
+                "Bytes waiting in outbound queues", STAT(queued));
+    put_counter(out, "chat_rooms", "gauge",
+                "Rooms with members, counted once per worker they span",
+                STAT(rooms));
+    put_counter(out, "chat_shard_dropped_total", "counter",
+                "Frames dropped because another worker's inbox was full",
+                STAT(shard_dropped));
+    put_counter(out, "chat_log_dropped_total", "counter",
+                "Log lines dropped because the log ring was full",
+                atomic_load(&log_dropped));
     
-    // Filter
-    size_t j = 0;
-    for (size_t i = 0; i < *n; i++) {
-        if (!(*conns)[i].marked) {
-            conns2[j] = (*conns)[i];
-            j++;
+    put_hist(out, "chat_loop_seconds",
+             "Busy time per event loop iteration",
+             offsetof(Stats, loop), 1e-9);
+    put_hist(out, "chat_fanout_seconds",
+             "Time from receiving a frame to the last peer writing it",
+             offsetof(Stats, fanout), 1e-9);
+    put_hist(out, "chat_queue_depth_frames",
+             "Frames already queued for a peer when one more is added",
+             offsetof(Stats, depth), 1);
+}
+
+void *admin_run(void *arg) {
+    while (1) {
+        int fd = accept(admin_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            // admin_finish() shut the socket down
+            break;
+        }
+        
+        // Whatever the request was, it gets the metrics
+        char req[1024];
+        struct timeval tv = { .tv_sec = 1 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (recv(fd, req, sizeof(req), 0) < 0) {
+            close(fd);
             continue;
         }
-        logthis("Deleting %s:%d\n",
-                strip((*conns)[i].addr),
-                (*conns)[i].port);
+        
+        char *body = NULL;
+        size_t len = 0;
+        FILE *out = open_memstream(&body, &len);
+        put_metrics(out);
+        fclose(out);
+        
+        char hdr[256];
+        int hlen = snprintf(hdr, sizeof(hdr),
+                            "HTTP/1.0 200 OK\r\n"
+                            "Content-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: %zu\r\n\r\n", len);
+        
+        struct iovec iov[2] = {
+            { .iov_base = hdr, .iov_len = hlen },
+            { .iov_base = body, .iov_len = len }
+        };
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+        if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) perror("sendmsg()");
+        
+        free(body);
+        close(fd);
+    }
+    
+    return NULL;
+}
+
+// Listen on 127.0.0.1:port, or on a unix socket if addr
+// looks like a path
+int admin_start(const char *addr) {
+    if (strchr(addr, '/')) {
+        struct sockaddr_un sa = { .sun_family = AF_UNIX };
+        if (strlen(addr) >= sizeof(sa.sun_path)) {
+            printf("Admin socket path is too long\n");
+            return -1;
+        }
+        strcpy(sa.sun_path, addr);
+        unlink(addr);
+        
+        if ((admin_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+            perror("socket()");
+            return -1;
+        }
+        if (bind(admin_fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+            perror("bind()");
+            close(admin_fd);
+            return -1;
+        }
+    }
+    else {
+        int port = atoi(addr);
+        if (port <= 0 || port > 65535) {
+            printf("Invalid admin port\n");
+            return -1;
+        }
+        
+        struct sockaddr_in sa = {
+            .sin_family = AF_INET,
+            .sin_port = htons(port),
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+        };
+        
+        if ((admin_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+            perror("socket()");
+            return -1;
+        }
+        int reuse = 1;
+        setsockopt(admin_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (bind(admin_fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+            perror("bind()");
+            close(admin_fd);
+            return -1;
+        }
     }
     
-    free(*conns);
+    if (listen(admin_fd, 8) < 0) {
+        perror("listen()");
+        close(admin_fd);
+        return -1;
+    }
     
-    *n = n2;
-    *conns = conns2;
+    logthis("Serving metrics on %s\n", addr);
+    return 0;
+}
+
+void admin_finish(void) {
+    // Makes the blocked accept() fail
+    shutdown(admin_fd, SHUT_RDWR);
+    pthread_join(admin_thread, NULL);
+    close(admin_fd);
+    if (strchr(admin_addr, '/')) unlink(admin_addr);
 }
 
 ////////////////////////////////
 
-int finish = 0;
-void intrhandle(int _sig) {
-    (void)_sig;
-    finish = 1;
+// Start a thread that leaves SIGINT to the main thread
+void spawn(pthread_t *t, void *(*fn)(void*), void *arg) {
+    sigset_t mask, old;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, &old);
+    
+    if (pthread_create(t, NULL, fn, arg)) {
+        perror("pthread_create()");
+        exit(1);
+    }
+    
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
 }
 
-////////////////////////////////
+void usage(const char *name) {
+    printf("Usage: %s [options] <port> <logfile>\n"
+           "  --hwm BYTES   outbound bytes queued per peer before it\n"
+           "                counts as slow (default %zu)\n"
+           "  --bulk-hwm BYTES  the same for parts of large messages\n"
+           "                (default %zu)\n"
+           "  --shed        drop frames for slow peers instead of\n"
+           "                disconnecting them\n"
+           "  --threads N   worker threads, each with its own\n"
+           "                listening socket (default %d)\n"
+           "  --max-conns N connection slots per worker (default %u)\n"
+           "  --backlog N   listen backlog per worker (default %d)\n"
+           "  --log-level L error, info or debug (default info)\n"
+           "  --admin ADDR  serve Prometheus metrics on 127.0.0.1:ADDR,\n"
+           "                or on a unix socket if ADDR is a path\n"
+           "  --io-uring    do the socket I/O through io_uring (Linux\n"
+           "                6.0+), falls back to epoll if unavailable\n"
+           "  --history N   recent frames replayed to newcomers, 0 to\n"
+           "                keep none (default %u)\n"
+           "  --history-bytes BYTES  most bytes they may take\n"
+           "                (default %zu)\n",
+           name, hwm, bulk_hwm, threads_n, max_conns, backlog,
+           history_n, history_bytes);
+}
 
 int main(int argc, char **argv) {
-    if (argc != 3) {
+    static struct option opts[] = {
+        {"hwm",  required_argument, 0, 'w'},
+        {"bulk-hwm", required_argument, 0, 'W'},
+        {"shed", no_argument,       0, 's'},
+        {"threads", required_argument, 0, 't'},
+        {"max-conns", required_argument, 0, 'c'},
+        {"backlog", required_argument, 0, 'b'},
+        {"log-level", required_argument, 0, 'l'},
+        {"admin", required_argument, 0, 'a'},
+        {"io-uring", no_argument,   0, 'u'},
+        {"history", required_argument, 0, 'H'},
+        {"history-bytes", required_argument, 0, 'B'},
+        {"help", no_argument,       0, 'h'},
+        {0}
+    };
+    
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'w':
+            hwm = strtoull(optarg, NULL, 10);
+            if (hwm < MAX_FRAME) {
+                printf("High-water mark should be at least %d\n", MAX_FRAME);
+                return -1;
+            }
+            break;
+        case 'W':
+            bulk_hwm = strtoull(optarg, NULL, 10);
+            if (bulk_hwm < MAX_FRAME) {
+                printf("High-water mark should be at least %d\n", MAX_FRAME);
+                return -1;
+            }
+            break;
+        case 's':
+            shed = 1;
+            break;
+        case 't':
+            threads_n = atoi(optarg);
+            if (threads_n < 1 || threads_n > MAX_THREADS) {
+                printf("Thread count should be within 1..%d\n", MAX_THREADS);
+                return -1;
+            }
+            break;
+        case 'c': {
+            long n = atol(optarg);
+            // io_uring handles keep the top bits of the slot
+            if (n < 1 || n > 1L << 30) {
+                printf("Invalid connection limit\n");
+                return -1;
+            }
+            max_conns = n;
+            break;
+        }
+        case 'b':
+            backlog = atoi(optarg);
+            if (backlog < 1) {
+                printf("Invalid backlog\n");
+                return -1;
+            }
+            break;
+        case 'l':
+            if (!strcmp(optarg, "error")) log_level = L_ERROR;
+            else if (!strcmp(optarg, "info")) log_level = L_INFO;
+            else if (!strcmp(optarg, "debug")) log_level = L_DEBUG;
+            else {
+                printf("Unknown log level '%s'\n", optarg);
+                return -1;
+            }
+            break;
+        case 'a':
+            admin_addr = optarg;
+            break;
+        case 'u':
+            use_uring = 1;
+            break;
+        case 'H':
+            history_n = strtoul(optarg, NULL, 10);
+            break;
+        case 'B':
+            history_bytes = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    
+    if (argc - optind != 2) {
         printf("Provide listen port and log file\n");
+        usage(argv[0]);
         return -1;
     }
     
-    int lport = atoi(argv[1]);
+    int lport = atoi(argv[optind]);
     
     if (lport <= 0) {
         printf("Invalid port\n");
         return -1;
     }
     
-    logfile = fopen(argv[2], "a");
+    logfile = fopen(argv[optind+1], "a");
     if (logfile == NULL) {
         perror("fopen()");
         return 1;
@@ -245,83 +2512,87 @@ int main(int argc, char **argv) {
     time_t t = time(NULL);
     fprintf(logfile, "\nSession begin %s\n", ctime(&t));
     
-    ////////////////////////////////
-    
-    signal(SIGINT, intrhandle);
-    
-    ////////////////////////////////
-    
-    int server = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    
-    if (server < 0) {
-        perror("socket()");
+    if (log_start() < 0) {
+        fclose(logfile);
         return 1;
     }
     
     ////////////////////////////////
-    // Allow reuse
     
-    int reuse = 1;
-    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    signal(SIGINT, intrhandle);
     
     ////////////////////////////////
     
-    struct sockaddr_in serveraddr;
-    memset(&serveraddr, 0, sizeof(serveraddr));
-    serveraddr.sin_family = AF_INET;
-    serveraddr.sin_port = htons(lport);
-    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    
+    workers = calloc(threads_n, sizeof(Worker));
     
-    if(bind(server, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) < 0) {
-        perror("bind()");
-        close(server);
-        return 1;
+    for (int i = 0; i < threads_n; i++) {
+        if (worker_init(&workers[i], i, lport) < 0) {
+            for (int j = 0; j <= i; j++) worker_free(&workers[j]);
+            free(workers);
+            log_finish();
+            fclose(logfile);
+            return 1;
+        }
     }
     
-    ////////////////////////////////
-    // Set non-blocking
+    logthis("Listening on %d with %d worker(s) on %s\n", lport, threads_n,
+            workers[0].uring ? "io_uring" : "epoll");
     
-    int flags = fcntl(server, F_GETFL, 0);
-    if (flags == -1) {
-        perror("fcntl()");
-        close(server);
-        return 1;
-    }
-    flags |= O_NONBLOCK;
-    if (fcntl(server, F_SETFL, flags)) {
-        perror("fcntl()");
-        close(server);
+    if (admin_addr && admin_start(admin_addr) < 0) {
+        for (int i = 0; i < threads_n; i++) worker_free(&workers[i]);
+        free(workers);
+        log_finish();
+        fclose(logfile);
         return 1;
     }
     
     ////////////////////////////////
+    // Only the main thread handles SIGINT, the workers get
+    // woken through their eventfd
     
-    if (listen(server, 8) < 0) {
-        perror("listen()");
-        close(server);
-        return 1;
+    for (int i = 0; i < threads_n; i++) {
+        spawn(&workers[i].thread, worker_run, &workers[i]);
     }
-    
-    logthis("Listening on %d\n", lport);
+    if (admin_addr) spawn(&admin_thread, admin_run, NULL);
     
     ////////////////////////////////
-    // Main loop
+    // Report how fast we are taking in new connections
     
-    Conn *conns = NULL;
-    size_t conns_n = 0;
+    u64 last = 0, peak = 0;
     
-    while (!finish) {
-        // In case of crashes
-        fflush(logfile);
+    while (!atomic_load_explicit(&finish, memory_order_relaxed)) {
+        sleep(1);
         
-        accept_all(server, &conns, &conns_n);
-        receive_and_resend(&conns, &conns_n);
-        delete_marked(&conns, &conns_n);
-        usleep(1000 * 200);
+        u64 total = 0;
+        for (int i = 0; i < threads_n; i++) {
+            total += atomic_load_explicit(&workers[i].stats.accepted,
+                                          memory_order_relaxed);
+        }
+        
+        u64 rate = total - last;
+        last = total;
+        if (!rate) continue;
+        
+        if (rate > peak) peak = rate;
+        logthis("Accept rate %llu/s (peak %llu/s, total %llu)\n",
+                (unsigned long long)rate,
+                (unsigned long long)peak,
+                (unsigned long long)total);
+    }
+    
+    for (int i = 0; i < threads_n; i++) {
+        u64 one = 1;
+        if (write(workers[i].wake, &one, sizeof(one)) < 0) perror("write()");
+    }
+    for (int i = 0; i < threads_n; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    if (admin_addr) admin_finish();
+    for (int i = 0; i < threads_n; i++) {
+        worker_free(&workers[i]);
     }
     
-    close(server);
-    free(conns);
+    free(workers);
+    log_finish();
     fclose(logfile);
-}
\ No newline at end of file
+}